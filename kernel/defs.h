@@ -1,13 +1,19 @@
 struct buf;
 struct context;
+struct fdtable;
 struct file;
 struct inode;
+struct kmem_cache;
+struct mm;
 struct pipe;
+struct pollfd;
 struct proc;
 struct spinlock;
 struct sleeplock;
 struct stat;
 struct superblock;
+struct timer;
+struct vma;
 
 // bio.c
 void            binit(void);
@@ -30,6 +36,8 @@ struct file*    filealloc(void);
 void            fileclose(struct file*);
 struct file*    filedup(struct file*);
 void            fileinit(void);
+int             filepoll(struct file**, struct pollfd*, int, int);
+void            pollwakeup(void);
 int             fileread(struct file*, uint64, int n);
 int             filestat(struct file*, uint64 addr);
 int             filewrite(struct file*, uint64, int n);
@@ -59,10 +67,33 @@ void            ramdiskinit(void);
 void            ramdiskintr(void);
 void            ramdiskrw(struct buf*);
 
+// futex.c
+void            futexinit(void);
+int             futexwait(uint64, uint32, uint64);
+int             futexwake(uint64, int);
+
+// ipi.c
+void            ipipoll(void);
+int             ipiintr(void);
+void            ipi_resched(int);
+void            ipi_call(int, void (*)(void*), void*);
+void            ipi_callall(void (*)(void*), void*);
+void            tlbshootdown(pagetable_t);
+int             ipistats(char*, int);
+
 // kalloc.c
 void*           kalloc(void);
+void*           kalloc_order(int);
+void            kfree_order(void*, int);
+void*           kalloc_zeroed(void);
+void            kzerofill(void);
 void            kfree(void *);
 void            kinit(void);
+int             kallocstats(char*, int);
+void            kdup(void *);
+void            kdup_order(void*, int);
+void            ksplit(void*, int);
+int             krefcount(void*, int);
 
 // log.c
 void            initlog(int, struct superblock*);
@@ -71,10 +102,12 @@ void            begin_op(void);
 void            end_op(void);
 
 // pipe.c
+void            pipeinit(void);
 int             pipealloc(struct file**, struct file**);
 void            pipeclose(struct pipe*, int);
-int             piperead(struct pipe*, uint64, int);
-int             pipewrite(struct pipe*, uint64, int);
+int             piperead(struct pipe*, uint64, int, int);
+int             pipewrite(struct pipe*, uint64, int, int);
+int             pipepoll(struct pipe*, int);
 
 // printf.c
 void            printf(char*, ...);
@@ -82,15 +115,19 @@ void            panic(char*) __attribute__((noreturn));
 void            printfinit(void);
 
 // proc.c
+int             clone(uint64, uint64, uint64);
 int             cpuid(void);
 void            exit(int);
 int             fork(void);
-int             growproc(int);
-void            proc_mapstacks(pagetable_t);
+int             growproc(int, uint64*);
 pagetable_t     proc_pagetable(struct proc *);
-void            proc_freepagetable(pagetable_t, uint64);
+int             join(int, uint64);
 int             kill(int);
+void            texit(int);
+struct proc*    procat(int);
+int             procstats(char*, int);
 int             killed(struct proc*);
+int             setpriority(int, int);
 void            setkilled(struct proc*);
 struct cpu*     mycpu(void);
 struct cpu*     getmycpu(void);
@@ -99,9 +136,11 @@ void            procinit(void);
 void            scheduler(void) __attribute__((noreturn));
 void            sched(void);
 void            sleep(void*, struct spinlock*);
+void            sleep_excl(void*, struct spinlock*);
 void            userinit(void);
 int             wait(uint64);
 void            wakeup(void*);
+void            wakeupn(void*, int);
 void            yield(void);
 int             either_copyout(int user_dst, uint64 dst, void *src, uint64 len);
 int             either_copyin(void *dst, int user_src, uint64 src, uint64 len);
@@ -110,6 +149,9 @@ void            procdump(void);
 // swtch.S
 void            swtch(struct context*, struct context*);
 
+// sprintf.c
+int             snprintf(char*, int, char*, ...);
+
 // spinlock.c
 void            acquire(struct spinlock*);
 int             holding(struct spinlock*);
@@ -118,12 +160,45 @@ void            release(struct spinlock*);
 void            push_off(void);
 void            pop_off(void);
 
+// slab.c
+void            kmem_cache_init(struct kmem_cache*, char*, uint);
+void*           kmem_cache_alloc(struct kmem_cache*);
+void            kmem_cache_free(struct kmem_cache*, void*);
+int             slabreclaim(void);
+int             slabstats(char*, int);
+
+// edf.c
+void            edfinit(void);
+int             edfadmit(int, int, int);
+void            edfexit(struct proc*);
+void            edfenqueue(struct proc*);
+struct proc*    edfpop(void);
+int             edfwaiting(void);
+int             edfpreempt(struct proc*);
+void            edftick(void);
+uint            edfnexttick(void);
+int             edfstats(char*, int);
+
+// sched.c
+void            runqinit(void);
+void            setrunnable(struct proc*);
+struct proc*    runqpop(struct cpu*);
+struct proc*    runqsteal(struct cpu*);
+void            schedtick(void);
+int             timeslice(void);
+void            cpuidle(struct cpu*);
+int             schedstats(char*, int);
+
 // sleeplock.c
 void            acquiresleep(struct sleeplock*);
 void            releasesleep(struct sleeplock*);
 int             holdingsleep(struct sleeplock*);
 void            initsleeplock(struct sleeplock*, char*);
 
+// stats.c
+void            statsinit(void);
+int             statsread(int, uint64, uint, int);
+
 // string.c
 int             memcmp(const void*, const void*, uint);
 void*           memmove(void*, const void*, uint);
@@ -141,12 +216,32 @@ int             fetchstr(uint64, char*, int);
 int             fetchaddr(uint64, uint64*);
 void            syscall();
 
+// thread.c
+void            threadinit(void);
+struct mm*      mmalloc(struct proc*);
+int             mmshare(struct proc*, struct mm*);
+int             mmexit(struct proc*);
+void            mmput(struct mm*, int);
+struct fdtable* fdtalloc(void);
+struct fdtable* fdtdup(struct fdtable*);
+void            fdtput(struct fdtable*);
+
+// timer.c
+void            wheelinit(void);
+void            timerrun(uint64);
+uint64          timernext(void);
+void            timeradd(struct timer*, uint64);
+int             timerdel(struct timer*);
+int             timersleep(uint64);
+
 // trap.c
 extern uint     ticks;
 void            trapinit(void);
 void            trapinithart(void);
 extern struct spinlock tickslock;
 void            usertrapret(void);
+void            timerset(uint64);
+void            timerarm(int);
 
 // uart.c
 void            uartinit(void);
@@ -159,20 +254,32 @@ int             uartgetc(void);
 void            kvminit(void);
 void            kvminithart(void);
 void            kvmmap(pagetable_t, uint64, uint64, uint64, int);
+int             kvmmapstack(uint64);
+uint64          kvmunmapstack(uint64);
 int             mappages(pagetable_t, uint64, uint64, uint64, int);
 pagetable_t     uvmcreate(void);
 void            uvmfirst(pagetable_t, uchar *, uint);
 uint64          uvmalloc(pagetable_t, uint64, uint64, int);
-uint64          uvmdealloc(pagetable_t, uint64, uint64);
+uint64          uvmdealloc(pagetable_t, uint64, uint64, int);
 int             uvmcopy(pagetable_t, pagetable_t, uint64);
+int             uvmshare(pagetable_t, pagetable_t, uint64, uint64, int);
+int             uvmcow(pagetable_t, uint64);
+int             uvmsplit(pagetable_t, uint64);
+int             vmfault(pagetable_t, uint64, int, int);
 void            uvmfree(pagetable_t, uint64);
 void            uvmunmap(pagetable_t, uint64, uint64, int);
 void            uvmclear(pagetable_t, uint64);
 pte_t *         walk(pagetable_t, uint64, int);
+pte_t *         walklevel(pagetable_t, uint64, int, int);
 uint64          walkaddr(pagetable_t, uint64);
 int             copyout(pagetable_t, uint64, char *, uint64);
+int             copyout_locked(pagetable_t, uint64, char *, uint64);
 int             copyin(pagetable_t, char *, uint64, uint64);
+int             copyin_locked(pagetable_t, char *, uint64, uint64);
 int             copyinstr(pagetable_t, char *, uint64, uint64);
+int             vmstats(char*, int);
+void            uvmprefault(pagetable_t, uint64, uint64, int);
+uint64          uvmtouch(pagetable_t, uint64, int, int);
 
 // plic.c
 void            plicinit(void);
@@ -180,6 +287,17 @@ void            plicinithart(void);
 int             plic_claim(void);
 void            plic_complete(int);
 
+// vma.c
+struct vma*     vmalookup(struct proc*, uint64);
+int             vmafill(struct mm*, struct vma*, uint64, int, int);
+void            vmadup(struct vma*, struct vma*);
+void            vmaclear(struct vma*);
+int             vmaoverlap(struct proc*, uint64, uint64);
+int             vmacopy(pagetable_t, pagetable_t, struct vma*);
+uint64          mmap(struct file*, uint64, int, int, uint);
+int             munmap(uint64, uint64);
+void            munmapall(struct proc*);
+
 // virtio_disk.c
 void            virtio_disk_init(void);
 void            virtio_disk_rw(struct buf *, int);
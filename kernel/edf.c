@@ -0,0 +1,279 @@
+//
+// Earliest-deadline-first real-time scheduling.
+//
+// A process that calls sched_deadline(runtime, period,
+// deadline) is promised runtime ticks of CPU within deadline
+// ticks of the start of each period. Real-time processes
+// wait on one queue shared by all CPUs, sorted by absolute
+// deadline, and runqpop() takes from it before the CPU's
+// own run queue, so they run ahead of everything else.
+//
+// A period starts when the process becomes RUNNABLE after
+// the last one ended. Each tick it runs comes off its budget
+// (see edftick(), called from clockintr()); when the budget
+// is gone the process is throttled, kept off the queue until
+// its next period starts. A process still running or waiting
+// to run when its deadline passes counts a miss and starts
+// a new period.
+//
+// Admission control keeps the sum of runtime/period over all
+// real-time processes at or below the number of CPUs.
+//
+// Locking: p->lock before edf.lock. While a real-time process
+// is RUNNABLE, edf.lock protects its dl_ fields; while it runs,
+// only its own CPU touches them.
+//
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "defs.h"
+
+#define BWSHIFT 16  // fixed-point fraction bits of a bandwidth
+
+struct {
+  struct spinlock lock;
+  struct proc *ready;         // by dl_abs, linked through p->rqnext
+  struct proc *throttled;     // out of budget until dl_next
+  uint64 bw;                  // sum of admitted runtime/period
+  uint64 nmiss;               // deadlines missed, by all processes
+  uint64 nthrottle;           // budgets used up
+  uint last;                  // tick of the last edftick() queue scan
+} edf;
+
+void
+edfinit(void)
+{
+  initlock(&edf.lock, "edf");
+}
+
+static uint64
+bandwidth(int runtime, int period)
+{
+  return ((uint64)runtime << BWSHIFT) / period;
+}
+
+// Start a new period for p at now.
+static void
+edfrenew(struct proc *p, uint now)
+{
+  p->dl_left = p->dl_runtime;
+  p->dl_abs = now + p->dl_deadline;
+  p->dl_next = now + p->dl_period;
+}
+
+// Insert p into the ready queue by deadline, after any
+// with the same deadline. Caller must hold edf.lock.
+static void
+edfinsert(struct proc *p)
+{
+  struct proc **pp;
+
+  for(pp = &edf.ready; *pp && (*pp)->dl_abs <= p->dl_abs; pp = &(*pp)->rqnext)
+    ;
+  p->rqnext = *pp;
+  *pp = p;
+}
+
+// Make the current process real-time with the given
+// parameters, in ticks, or an ordinary process again if
+// all three are 0.
+// Returns 0, or -1 if they don't make sense or would
+// overcommit the CPUs.
+int
+edfadmit(int runtime, int period, int deadline)
+{
+  struct proc *p = myproc();
+  uint64 bw, old;
+
+  if(runtime == 0 && period == 0 && deadline == 0){
+    edfexit(p);
+    return 0;
+  }
+  if(runtime <= 0 || runtime > deadline || deadline > period)
+    return -1;
+
+  bw = bandwidth(runtime, period);
+  old = p->dl_runtime ? bandwidth(p->dl_runtime, p->dl_period) : 0;
+  acquire(&edf.lock);
+  if(edf.bw - old + bw > ((uint64)ncpu << BWSHIFT)){
+    release(&edf.lock);
+    return -1;
+  }
+  edf.bw = edf.bw - old + bw;
+  p->dl_runtime = runtime;
+  p->dl_period = period;
+  p->dl_deadline = deadline;
+  edfrenew(p, ticks);
+  release(&edf.lock);
+  return 0;
+}
+
+// The current process p is exiting or leaving the class:
+// give back its bandwidth.
+void
+edfexit(struct proc *p)
+{
+  if(p->dl_runtime == 0)
+    return;
+  acquire(&edf.lock);
+  edf.bw -= bandwidth(p->dl_runtime, p->dl_period);
+  p->dl_runtime = 0;
+  release(&edf.lock);
+}
+
+// Queue real-time process p, which is becoming RUNNABLE.
+// Caller must hold p->lock.
+void
+edfenqueue(struct proc *p)
+{
+  uint now = ticks;
+
+  acquire(&edf.lock);
+  if(p->dl_left == 0 && now < p->dl_next){
+    p->rqnext = edf.throttled;
+    edf.throttled = p;
+    edf.nthrottle++;
+  } else {
+    if(p->dl_left == 0 || now >= p->dl_abs)
+      edfrenew(p, now);
+    edfinsert(p);
+  }
+  release(&edf.lock);
+}
+
+// Take the real-time process with the earliest deadline
+// off the queue, or return 0. As with runqpop(), the caller
+// must lock it and check that it is RUNNABLE.
+struct proc*
+edfpop(void)
+{
+  struct proc *p;
+
+  if(edf.ready == 0)
+    return 0;
+  acquire(&edf.lock);
+  if((p = edf.ready) != 0){
+    edf.ready = p->rqnext;
+    p->rqnext = 0;
+  }
+  release(&edf.lock);
+  return p;
+}
+
+// Is any real-time process waiting to run? An unlocked look.
+int
+edfwaiting(void)
+{
+  return edf.ready != 0;
+}
+
+// Should real-time process p, which is running, give up
+// the CPU at this tick?
+int
+edfpreempt(struct proc *p)
+{
+  struct proc *q;
+
+  if(p->dl_left == 0)
+    return 1;
+  q = edf.ready;
+  return q != 0 && q->dl_abs < p->dl_abs;
+}
+
+// Called from clockintr() on every CPU at every tick, with
+// interrupts off. Charges the running real-time process for
+// the tick. Once per tick, whichever CPU gets here first also
+// starts the periods of throttled processes and counts the
+// deadlines of waiting ones; with idle CPUs taking no ticks,
+// CPU 0 may not be taking any.
+void
+edftick(void)
+{
+  struct proc *p = myproc(), *q, *late, **pp;
+  uint now = ticks;
+
+  if(p && p->dl_runtime && p->state == RUNNING){
+    if(p->dl_left > 0)
+      p->dl_left--;
+    if(p->dl_left > 0 && now >= p->dl_abs){
+      p->dl_misses++;
+      __sync_fetch_and_add(&edf.nmiss, 1);
+      edfrenew(p, now);
+    }
+  }
+
+  if(edf.ready == 0 && edf.throttled == 0)
+    return;
+
+  acquire(&edf.lock);
+  if(edf.last == now){
+    release(&edf.lock);
+    return;
+  }
+  edf.last = now;
+  late = 0;
+  for(pp = &edf.throttled; (q = *pp) != 0; ){
+    if(now >= q->dl_next){
+      *pp = q->rqnext;
+      q->rqnext = late;
+      late = q;
+    } else {
+      pp = &q->rqnext;
+    }
+  }
+  while((q = edf.ready) != 0 && now >= q->dl_abs){
+    edf.ready = q->rqnext;
+    q->dl_misses++;
+    __sync_fetch_and_add(&edf.nmiss, 1);
+    q->rqnext = late;
+    late = q;
+  }
+  while((q = late) != 0){
+    late = q->rqnext;
+    edfrenew(q, now);
+    edfinsert(q);
+  }
+  release(&edf.lock);
+}
+
+// The tick at which the next throttled real-time process
+// may run again, or ~0 if none is throttled.
+uint
+edfnexttick(void)
+{
+  struct proc *p;
+  uint t = ~0;
+
+  acquire(&edf.lock);
+  for(p = edf.throttled; p; p = p->rqnext){
+    if(p->dl_next < t)
+      t = p->dl_next;
+  }
+  release(&edf.lock);
+  return t;
+}
+
+// Report the admitted bandwidth, misses, and each
+// real-time process's parameters and misses.
+int
+edfstats(char *buf, int sz)
+{
+  struct proc *p;
+  int n;
+
+  n = snprintf(buf, sz, "edf: admitted %d%% of %d cpus, misses %ld throttled %ld\n",
+               (int)((edf.bw * 100) >> BWSHIFT), ncpu, edf.nmiss, edf.nthrottle);
+  for(int i = 0; (p = procat(i)) != 0; i++){
+    acquire(&p->lock);
+    if(p->state != UNUSED && p->dl_runtime){
+      n += snprintf(buf+n, sz-n, "edf: pid %d runtime %d period %d deadline %d misses %ld\n",
+                    p->pid, p->dl_runtime, p->dl_period, p->dl_deadline, p->dl_misses);
+    }
+    release(&p->lock);
+  }
+  return n;
+}
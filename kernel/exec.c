@@ -4,11 +4,12 @@
 #include "riscv.h"
 #include "spinlock.h"
 #include "proc.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "file.h"
 #include "defs.h"
 #include "elf.h"
 
-static int loadseg(pde_t *, uint64, struct inode *, uint, uint);
-
 int flags2perm(int flags)
 {
     int perm = 0;
@@ -19,18 +20,30 @@ int flags2perm(int flags)
     return perm;
 }
 
+// Program segments are not read in here. Each one becomes a
+// region (struct vma) that holds a reference to the executable,
+// and vmfault() reads a page in when the program first touches it.
 int
 exec(char *path, char **argv)
 {
   char *s, *last;
-  int i, off;
+  int i, off, nvma = 0;
   uint64 argc, sz = 0, sp, ustack[MAXARG], stackbase;
   struct elfhdr elf;
   struct inode *ip;
   struct proghdr ph;
-  pagetable_t pagetable = 0, oldpagetable;
+  struct vma vmas[NVMA], *v;
+  pagetable_t pagetable;
+  struct mm *mm = 0, *oldmm;
+  int oldslot;
   struct proc *p = myproc();
 
+  // the other threads would lose their memory.
+  if(p->mm->users > 1)
+    return -1;
+
+  memset(vmas, 0, sizeof(vmas));
+
   begin_op();
 
   if((ip = namei(path)) == 0){
@@ -46,8 +59,9 @@ exec(char *path, char **argv)
   if(elf.magic != ELF_MAGIC)
     goto bad;
 
-  if((pagetable = proc_pagetable(p)) == 0)
+  if((mm = mmalloc(p)) == 0)
     goto bad;
+  pagetable = mm->pagetable;
 
   // Load program into memory.
   for(i=0, off=elf.phoff; i<elf.phnum; i++, off+=sizeof(ph)){
@@ -61,19 +75,26 @@ exec(char *path, char **argv)
       goto bad;
     if(ph.vaddr % PGSIZE != 0)
       goto bad;
-    uint64 sz1;
-    if((sz1 = uvmalloc(pagetable, sz, ph.vaddr + ph.memsz, flags2perm(ph.flags))) == 0)
+    if(ph.vaddr < sz || ph.vaddr + ph.memsz > USERTOP)
+      goto bad;
+    if(ph.off + ph.filesz < ph.off || ph.off + ph.filesz > ip->size)
       goto bad;
-    sz = sz1;
-    if(loadseg(pagetable, ph.vaddr, ip, ph.off, ph.filesz) < 0)
+    if(nvma >= NVMA)
       goto bad;
+    v = &vmas[nvma++];
+    v->start = ph.vaddr;
+    v->end = ph.vaddr + ph.memsz;
+    v->perm = PTE_R | PTE_U | flags2perm(ph.flags);
+    v->ip = idup(ip);
+    v->off = ph.off;
+    v->filesz = ph.filesz;
+    sz = ph.vaddr + ph.memsz;
   }
   iunlockput(ip);
   end_op();
   ip = 0;
 
   p = myproc();
-  uint64 oldsz = p->sz;
 
   // Allocate two pages at the next page boundary.
   // Make the first inaccessible as a stack guard.
@@ -83,6 +104,7 @@ exec(char *path, char **argv)
   if((sz1 = uvmalloc(pagetable, sz, sz + 2*PGSIZE, PTE_W)) == 0)
     goto bad;
   sz = sz1;
+  mm->sz = sz;
   uvmclear(pagetable, sz-2*PGSIZE);
   sp = sz;
   stackbase = sp - PGSIZE;
@@ -120,47 +142,38 @@ exec(char *path, char **argv)
       last = s+1;
   safestrcpy(p->name, last, sizeof(p->name));
     
-  // Commit to the user image.
-  oldpagetable = p->pagetable;
-  p->pagetable = pagetable;
-  p->sz = sz;
+  // Commit to the user image. exited threads may still
+  // hold the old address space until they are reaped.
+  if(mmexit(p)){
+    munmapall(p);
+    begin_op();
+    vmaclear(p->mm->vmas);
+    end_op();
+  }
+  memmove(mm->vmas, vmas, sizeof(vmas));
+  oldmm = p->mm;
+  oldslot = p->tfslot;
+  p->mm = mm;
+  p->tfslot = 0;
   p->trapframe->epc = elf.entry;  // initial program counter = main
   p->trapframe->sp = sp; // initial stack pointer
-  proc_freepagetable(oldpagetable, oldsz);
+  mmput(oldmm, oldslot);
 
   return argc; // this ends up in a0, the first argument to main(argc, argv)
 
  bad:
-  if(pagetable)
-    proc_freepagetable(pagetable, sz);
+  if(mm)
+    mmput(mm, 0);
   if(ip){
+    // still in the transaction; ip's own reference keeps
+    // these from being the last ones.
+    vmaclear(vmas);
     iunlockput(ip);
     end_op();
+  } else {
+    begin_op();
+    vmaclear(vmas);
+    end_op();
   }
   return -1;
 }
-
-// Load a program segment into pagetable at virtual address va.
-// va must be page-aligned
-// and the pages from va to va+sz must already be mapped.
-// Returns 0 on success, -1 on failure.
-static int
-loadseg(pagetable_t pagetable, uint64 va, struct inode *ip, uint offset, uint sz)
-{
-  uint i, n;
-  uint64 pa;
-
-  for(i = 0; i < sz; i += PGSIZE){
-    pa = walkaddr(pagetable, va + i);
-    if(pa == 0)
-      panic("loadseg: address should exist");
-    if(sz - i < PGSIZE)
-      n = sz - i;
-    else
-      n = PGSIZE;
-    if(readi(ip, 0, (uint64)pa, offset+i, n) != n)
-      return -1;
-  }
-  
-  return 0;
-}
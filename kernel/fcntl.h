@@ -3,3 +3,25 @@
 #define O_RDWR    0x002
 #define O_CREATE  0x200
 #define O_TRUNC   0x400
+#define O_NONBLOCK 0x800
+
+// fcntl() commands
+#define F_GETFL   1
+#define F_SETFL   2
+
+// poll() events
+#define POLLIN    0x1
+#define POLLOUT   0x4
+
+struct pollfd {
+  int fd;
+  short events;   // POLLIN and/or POLLOUT
+  short revents;  // the events that are ready
+};
+
+#define PROT_READ     0x1
+#define PROT_WRITE    0x2
+#define PROT_EXEC     0x4
+
+#define MAP_SHARED    0x01
+#define MAP_PRIVATE   0x02
@@ -6,23 +6,38 @@
 #include "riscv.h"
 #include "defs.h"
 #include "param.h"
+#include "memlayout.h"
 #include "fs.h"
 #include "spinlock.h"
 #include "sleeplock.h"
 #include "file.h"
 #include "stat.h"
 #include "proc.h"
+#include "slab.h"
+#include "fcntl.h"
 
 struct devsw devsw[NDEV];
+
+// file structures come from filecache; ftable.lock
+// protects their reference counts.
 struct {
   struct spinlock lock;
-  struct file file[NFILE];
 } ftable;
 
+struct kmem_cache filecache;
+
+// processes in poll() sleep on npollers, and are all woken
+// whenever a pipe's state changes, to look again.
+// Locking: polllock before a pipe's lock.
+struct spinlock polllock;
+int npollers;
+
 void
 fileinit(void)
 {
   initlock(&ftable.lock, "ftable");
+  initlock(&polllock, "poll");
+  kmem_cache_init(&filecache, "file", sizeof(struct file));
 }
 
 // Allocate a file structure.
@@ -31,16 +46,11 @@ filealloc(void)
 {
   struct file *f;
 
-  acquire(&ftable.lock);
-  for(f = ftable.file; f < ftable.file + NFILE; f++){
-    if(f->ref == 0){
-      f->ref = 1;
-      release(&ftable.lock);
-      return f;
-    }
-  }
-  release(&ftable.lock);
-  return 0;
+  if((f = kmem_cache_alloc(&filecache)) == 0)
+    return 0;
+  memset(f, 0, sizeof(*f));
+  f->ref = 1;
+  return f;
 }
 
 // Increment ref count for file f.
@@ -69,9 +79,8 @@ fileclose(struct file *f)
     return;
   }
   ff = *f;
-  f->ref = 0;
-  f->type = FD_NONE;
   release(&ftable.lock);
+  kmem_cache_free(&filecache, f);
 
   if(ff.type == FD_PIPE){
     pipeclose(ff.pipe, ff.writable);
@@ -94,7 +103,7 @@ filestat(struct file *f, uint64 addr)
     ilock(f->ip);
     stati(f->ip, &st);
     iunlock(f->ip);
-    if(copyout(p->pagetable, addr, (char *)&st, sizeof(st)) < 0)
+    if(copyout(p->mm->pagetable, addr, (char *)&st, sizeof(st)) < 0)
       return -1;
     return 0;
   }
@@ -112,11 +121,21 @@ fileread(struct file *f, uint64 addr, int n)
     return -1;
 
   if(f->type == FD_PIPE){
-    r = piperead(f->pipe, addr, n);
+    r = piperead(f->pipe, addr, n, f->nonblock);
   } else if(f->type == FD_DEVICE){
-    if(f->major < 0 || f->major >= NDEV || !devsw[f->major].read)
+    if(f->major < 0 || f->major >= NDEV)
       return -1;
-    r = devsw[f->major].read(1, addr, n);
+    if(devsw[f->major].pread){
+      // the inode lock guards f->off, as for FD_INODE.
+      ilock(f->ip);
+      if((r = devsw[f->major].pread(1, addr, f->off, n)) > 0)
+        f->off += r;
+      iunlock(f->ip);
+    } else if(devsw[f->major].read){
+      r = devsw[f->major].read(1, addr, n);
+    } else {
+      return -1;
+    }
   } else if(f->type == FD_INODE){
     ilock(f->ip);
     if((r = readi(f->ip, 1, addr, f->off, n)) > 0)
@@ -140,7 +159,7 @@ filewrite(struct file *f, uint64 addr, int n)
     return -1;
 
   if(f->type == FD_PIPE){
-    ret = pipewrite(f->pipe, addr, n);
+    ret = pipewrite(f->pipe, addr, n, f->nonblock);
   } else if(f->type == FD_DEVICE){
     if(f->major < 0 || f->major >= NDEV || !devsw[f->major].write)
       return -1;
@@ -180,3 +199,86 @@ filewrite(struct file *f, uint64 addr, int n)
   return ret;
 }
 
+
+// Wake processes in poll(), after a pipe's state has
+// changed. Caller must not hold the pipe's lock.
+void
+pollwakeup(void)
+{
+  // a poller counts itself before it looks at any pipe,
+  // under the pipe's lock, so it can't be missed here.
+  if(npollers == 0)
+    return;
+  acquire(&polllock);
+  wakeup(&npollers);
+  release(&polllock);
+}
+
+// p->timer's function during a timed poll().
+static void
+pollexpire(struct timer *t)
+{
+  acquire(&polllock);
+  *(int*)t->arg = 1;
+  wakeup(&npollers);
+  release(&polllock);
+}
+
+// Which of events (POLLIN, POLLOUT) f is ready for. Only a
+// pipe can make a reader or writer wait.
+static int
+filepollone(struct file *f, int events)
+{
+  if(!f->readable)
+    events &= ~POLLIN;
+  if(!f->writable)
+    events &= ~POLLOUT;
+  if(f->type == FD_PIPE)
+    return pipepoll(f->pipe, events);
+  return events;
+}
+
+// Wait until at least one of the n files is ready for the
+// events asked for in pfds, or ms milliseconds pass (with no
+// limit if ms < 0), and fill in each revents.
+// Returns the number of files ready, or -1 if the process
+// was killed.
+int
+filepoll(struct file **files, struct pollfd *pfds, int n, int ms)
+{
+  struct proc *p = myproc();
+  int i, ready, expired = 0;
+
+  // start the timer before taking polllock, since its
+  // function takes polllock under the wheel's.
+  if(ms > 0){
+    p->timer.fn = pollexpire;
+    p->timer.arg = &expired;
+    timeradd(&p->timer, r_time() + (uint64)ms * (CLINT_HZ / 1000));
+    timerarm(0);
+  }
+
+  acquire(&polllock);
+  npollers++;
+  for(;;){
+    ready = 0;
+    for(i = 0; i < n; i++){
+      pfds[i].revents = filepollone(files[i], pfds[i].events);
+      if(pfds[i].revents)
+        ready++;
+    }
+    if(ready || ms == 0 || expired)
+      break;
+    if(killed(p)){
+      ready = -1;
+      break;
+    }
+    sleep(&npollers, &polllock);
+  }
+  npollers--;
+  release(&polllock);
+
+  if(ms > 0)
+    timerdel(&p->timer);
+  return ready;
+}
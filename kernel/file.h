@@ -3,9 +3,10 @@ struct file {
   int ref; // reference count
   char readable;
   char writable;
+  char nonblock;     // O_NONBLOCK: fail rather than wait (pipes)
   struct pipe *pipe; // FD_PIPE
   struct inode *ip;  // FD_INODE and FD_DEVICE
-  uint off;          // FD_INODE
+  uint off;          // FD_INODE, and FD_DEVICE with pread
   short major;       // FD_DEVICE
 };
 
@@ -18,6 +19,7 @@ struct inode {
   uint dev;           // Device number
   uint inum;          // Inode number
   int ref;            // Reference count
+  struct inode *next; // next entry in the inode table
   struct sleeplock lock; // protects everything below here
   int valid;          // inode has been read from disk?
 
@@ -33,8 +35,10 @@ struct inode {
 struct devsw {
   int (*read)(int, uint64, int);
   int (*write)(int, uint64, int);
+  int (*pread)(int, uint64, uint, int);  // read at the file's offset, instead of read
 };
 
 extern struct devsw devsw[];
 
 #define CONSOLE 1
+#define STATS   2
@@ -20,6 +20,7 @@
 #include "fs.h"
 #include "buf.h"
 #include "file.h"
+#include "slab.h"
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
 // there should be one superblock per disk device, but we run with
@@ -134,7 +135,9 @@ bfree(int dev, uint b)
 //   the number of in-memory pointers to the entry (open
 //   files and current directories). iget() finds or
 //   creates a table entry and increments its ref; iput()
-//   decrements ref.
+//   decrements ref. Entries come from inodecache: the
+//   table keeps up to NINODE entries, free or not, and
+//   grows beyond that only while more are in use.
 //
 // * Valid: the information (type, size, &c) in an inode
 //   table entry is only correct when ip->valid is 1.
@@ -175,18 +178,17 @@ bfree(int dev, uint b)
 
 struct {
   struct spinlock lock;
-  struct inode inode[NINODE];
+  struct inode *inode;  // list of entries, linked by ip->next
+  int n;                // entries on the list
 } itable;
 
+struct kmem_cache inodecache;
+
 void
 iinit()
 {
-  int i = 0;
-  
   initlock(&itable.lock, "itable");
-  for(i = 0; i < NINODE; i++) {
-    initsleeplock(&itable.inode[i].lock, "inode");
-  }
+  kmem_cache_init(&inodecache, "inode", sizeof(struct inode));
 }
 
 static struct inode* iget(uint dev, uint inum);
@@ -252,7 +254,7 @@ iget(uint dev, uint inum)
 
   // Is the inode already in the table?
   empty = 0;
-  for(ip = &itable.inode[0]; ip < &itable.inode[NINODE]; ip++){
+  for(ip = itable.inode; ip; ip = ip->next){
     if(ip->ref > 0 && ip->dev == dev && ip->inum == inum){
       ip->ref++;
       release(&itable.lock);
@@ -262,9 +264,15 @@ iget(uint dev, uint inum)
       empty = ip;
   }
 
-  // Recycle an inode entry.
-  if(empty == 0)
-    panic("iget: no inodes");
+  // Recycle an inode entry, or add one if all are in use.
+  if(empty == 0){
+    if((empty = kmem_cache_alloc(&inodecache)) == 0)
+      panic("iget: no inodes");
+    initsleeplock(&empty->lock, "inode");
+    empty->next = itable.inode;
+    itable.inode = empty;
+    itable.n++;
+  }
 
   ip = empty;
   ip->dev = dev;
@@ -328,7 +336,7 @@ iunlock(struct inode *ip)
 
 // Drop a reference to an in-memory inode.
 // If that was the last reference, the inode table entry can
-// be recycled.
+// be recycled, or freed if the table holds more than NINODE.
 // If that was the last reference and the inode has no links
 // to it, free the inode (and its content) on disk.
 // All calls to iput() must be inside a transaction in
@@ -358,6 +366,15 @@ iput(struct inode *ip)
   }
 
   ip->ref--;
+  if(ip->ref == 0 && itable.n > NINODE){
+    // the table grew past NINODE; shrink it back.
+    struct inode **pp;
+    for(pp = &itable.inode; *pp != ip; pp = &(*pp)->next)
+      ;
+    *pp = ip->next;
+    itable.n--;
+    kmem_cache_free(&inodecache, ip);
+  }
   release(&itable.lock);
 }
 
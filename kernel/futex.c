@@ -0,0 +1,222 @@
+//
+// Fast user-space locking.
+//
+// futex_wait(addr, val, ns) sleeps if the 32-bit word at user
+// address addr still holds val, until futex_wake(addr, n) is
+// called for the same word, so user code can do its locking
+// with atomic instructions and enter the kernel only to wait.
+//
+// A futex in a MAP_SHARED region is known by the physical
+// address of its word, so that every process mapping the
+// page shares it. Any other futex is known by its address
+// space and user address, which threads share, and which
+// stay the same when copy-on-write moves the word to a
+// new page.
+//
+// Waiters are kept in a table of lists hashed by that key;
+// each waiter is a struct futexwait on the waiting
+// process's kernel stack.
+//
+// Locking: a wheel's lock before a bucket's lock before
+// mm->lock and a wait queue's lock.
+//
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "fcntl.h"
+#include "defs.h"
+
+#define NFUTEX 64
+
+struct futexwait {
+  struct mm *mm;              // address space of a private futex, or 0
+  uint64 key;                 // user address if private, else physical
+  struct futexwait *next;
+  int woken;                  // by futex_wake()
+  int expired;                // by the timeout
+};
+
+struct futexbucket {
+  struct spinlock lock;
+  struct futexwait *head;
+};
+
+static struct futexbucket futexes[NFUTEX];
+
+void
+futexinit(void)
+{
+  for(int i = 0; i < NFUTEX; i++)
+    initlock(&futexes[i].lock, "futex");
+}
+
+static struct futexbucket*
+futexbucket(struct mm *mm, uint64 key)
+{
+  return &futexes[(((uint64)mm >> 6) ^ (key >> 2)) % NFUTEX];
+}
+
+// Set *mm and *key to the key of the current process's
+// word at user address addr. The word is looked up as a
+// store would see it, so a shared page is faulted in.
+// Returns 0, or -1 if addr is misaligned or can't be
+// stored to.
+static int
+futexkey(uint64 addr, struct mm **mm, uint64 *key)
+{
+  struct proc *p = myproc();
+  struct vma *v;
+  uint64 pa;
+
+  if(addr % sizeof(uint32))
+    return -1;
+  if((pa = uvmtouch(p->mm->pagetable, PGROUNDDOWN(addr), 1, 1)) == 0)
+    return -1;
+  acquire(&p->mm->lock);
+  v = vmalookup(p, addr);
+  if(v && (v->flags & MAP_SHARED)){
+    *mm = 0;
+    *key = pa + (addr - PGROUNDDOWN(addr));
+  } else {
+    *mm = p->mm;
+    *key = addr;
+  }
+  release(&p->mm->lock);
+  return 0;
+}
+
+// Read the word that w's key names into *val, as it is
+// now. Returns 0, or -1 (with *val 0) if a private word is
+// no longer mapped. Caller must hold w's bucket's lock.
+static int
+futexload(struct futexwait *w, uint32 *val)
+{
+  uint64 pa;
+
+  if(w->mm == 0){
+    *val = *(volatile uint32*)w->key;
+    return 0;
+  }
+  // under mm->lock, so a copy-on-write fault can't be
+  // moving the word meanwhile.
+  acquire(&w->mm->lock);
+  *val = 0;
+  if((pa = walkaddr(w->mm->pagetable, w->key)) != 0)
+    *val = *(volatile uint32*)pa;
+  release(&w->mm->lock);
+  return pa ? 0 : -1;
+}
+
+// Take w off bucket b. Caller must hold b->lock.
+static void
+futexunlink(struct futexbucket *b, struct futexwait *w)
+{
+  struct futexwait **pp;
+
+  for(pp = &b->head; *pp; pp = &(*pp)->next){
+    if(*pp == w){
+      *pp = w->next;
+      return;
+    }
+  }
+}
+
+// p->timer's function during a timed futex_wait().
+static void
+futexexpire(struct timer *t)
+{
+  struct futexwait *w = t->arg;
+  struct futexbucket *b = futexbucket(w->mm, w->key);
+
+  acquire(&b->lock);
+  w->expired = 1;
+  wakeup(w);
+  release(&b->lock);
+}
+
+// Sleep until woken by futexwake() on the word at addr, if
+// it holds val, for at most cycles of CLINT_MTIME, or with
+// no limit if cycles is 0.
+// Returns 0 if woken, 1 if the time ran out, or -1 if the
+// word didn't hold val, addr is bad, or the process was
+// killed.
+int
+futexwait(uint64 addr, uint32 val, uint64 cycles)
+{
+  struct proc *p = myproc();
+  struct futexbucket *b;
+  struct futexwait w, **pp;
+  uint32 cur;
+  int r;
+
+  if(futexkey(addr, &w.mm, &w.key) < 0)
+    return -1;
+  w.woken = w.expired = 0;
+  b = futexbucket(w.mm, w.key);
+
+  // start the timer before taking b->lock, since its
+  // function takes b->lock under the wheel's.
+  if(cycles){
+    p->timer.fn = futexexpire;
+    p->timer.arg = &w;
+    timeradd(&p->timer, r_time() + cycles);
+    timerarm(0);
+  }
+
+  acquire(&b->lock);
+  if(futexload(&w, &cur) < 0 || cur != val){
+    r = -1;
+  } else {
+    // at the tail, so the longest waiting are woken first.
+    for(pp = &b->head; *pp; pp = &(*pp)->next)
+      ;
+    w.next = 0;
+    *pp = &w;
+    while(!w.woken && !w.expired && !killed(p))
+      sleep(&w, &b->lock);
+    if(w.woken){
+      r = 0;
+    } else {
+      futexunlink(b, &w);
+      r = w.expired ? 1 : -1;
+    }
+  }
+  release(&b->lock);
+
+  if(cycles)
+    timerdel(&p->timer);
+  return r;
+}
+
+// Wake up to n processes waiting on the word at addr.
+// Returns the number woken, or -1 if addr is bad.
+int
+futexwake(uint64 addr, int n)
+{
+  struct futexbucket *b;
+  struct futexwait *w, **pp;
+  struct mm *mm;
+  uint64 key;
+  int woken = 0;
+
+  if(futexkey(addr, &mm, &key) < 0)
+    return -1;
+  b = futexbucket(mm, key);
+  acquire(&b->lock);
+  for(pp = &b->head; (w = *pp) != 0 && woken < n; ){
+    if(w->mm == mm && w->key == key){
+      *pp = w->next;
+      w->woken = 1;
+      wakeup(w);
+      woken++;
+    } else {
+      pp = &w->next;
+    }
+  }
+  release(&b->lock);
+  return woken;
+}
@@ -0,0 +1,193 @@
+//
+// Inter-processor interrupts.
+//
+// A CPU interrupts another by writing the target's CLINT
+// MSIP register; timervec in kernelvec.S passes the machine
+// software interrupt on to supervisor mode, and devintr()
+// calls ipiintr(). Each CPU has a word of pending IPI types,
+// so several requests can share one interrupt:
+//
+//   IPI_RESCHED  give up the CPU, or leave wfi: there is
+//                work here (ipi_resched()).
+//   IPI_CALL     run a function (ipi_call()).
+//   IPI_TLB      flush the TLB (tlbshootdown()).
+//
+// A CPU takes one IPI_CALL or IPI_TLB at a time, and the
+// sender waits until it is done. The sender may be waiting
+// with interrupts off, so it serves calls aimed at its own
+// CPU while it waits; otherwise two CPUs calling each other
+// would deadlock.
+//
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "defs.h"
+
+#define IPI_RESCHED 0
+#define IPI_CALL    1
+#define IPI_TLB     2
+#define NIPI        3
+
+#define SYNCIPIS ((1 << IPI_CALL) | (1 << IPI_TLB))
+
+struct ipislot {
+  int busy;                   // a CALL or TLB to this CPU is under way
+  uint pending;               // 1 << IPI_* for each type sent
+  void (*fn)(void*);          // the IPI_CALL function and argument
+  void *arg;
+  volatile int done;          // the CALL or TLB has finished
+  uint64 n[NIPI];             // IPIs received, by type
+};
+
+static struct ipislot ipis[NCPU];
+
+static char *names[NIPI] = {
+[IPI_RESCHED] "resched",
+[IPI_CALL]    "call",
+[IPI_TLB]     "tlb",
+};
+
+// Send an IPI of the given type to cpu.
+static void
+ipisend(int cpu, int type)
+{
+  __sync_fetch_and_or(&ipis[cpu].pending, 1 << type);
+  *(volatile uint32*)CLINT_MSIP(cpu) = 1;
+}
+
+// Handle this CPU's pending IPIs among the types in mask.
+// Interrupts must be off.
+// Returns 1 if a reschedule was asked for.
+static int
+ipihandle(uint mask)
+{
+  struct ipislot *s = &ipis[cpuid()];
+  uint bits;
+
+  bits = __sync_fetch_and_and(&s->pending, ~mask) & mask;
+  for(int i = 0; i < NIPI; i++){
+    if(bits & (1 << i))
+      s->n[i]++;
+  }
+  if(bits & (1 << IPI_TLB))
+    sfence_vma();
+  if(bits & (1 << IPI_CALL))
+    s->fn(s->arg);
+  if(bits & SYNCIPIS){
+    __sync_synchronize();
+    s->done = 1;
+  }
+  return (bits & (1 << IPI_RESCHED)) != 0;
+}
+
+// Flush the TLB if another CPU has asked, for a CPU spinning
+// with interrupts off in acquire(): tlbshootdown() may be
+// waiting on it while holding the lock it wants.
+void
+ipipoll(void)
+{
+  if(ipis[cpuid()].pending & (1 << IPI_TLB))
+    ipihandle(1 << IPI_TLB);
+}
+
+// Called by devintr() for a software interrupt that wasn't
+// the timer. Returns 1 if a reschedule was asked for.
+int
+ipiintr(void)
+{
+  return ipihandle(~0);
+}
+
+// Send an IPI_CALL or IPI_TLB to cpu and wait for it to
+// be handled.
+static void
+ipisync(int cpu, int type, void (*fn)(void*), void *arg)
+{
+  struct ipislot *s = &ipis[cpu];
+
+  push_off();
+  if(cpu == cpuid()){
+    if(type == IPI_TLB)
+      sfence_vma();
+    else
+      fn(arg);
+    pop_off();
+    return;
+  }
+  while(__sync_lock_test_and_set(&s->busy, 1) != 0)
+    ipihandle(SYNCIPIS);
+  __sync_synchronize();
+  s->fn = fn;
+  s->arg = arg;
+  s->done = 0;
+  ipisend(cpu, type);
+  while(!s->done)
+    ipihandle(SYNCIPIS);
+  __sync_lock_release(&s->busy);
+  pop_off();
+}
+
+// Ask cpu to reschedule: to leave wfi if it is idle, or to
+// give up the CPU at once if a process is running there.
+void
+ipi_resched(int cpu)
+{
+  ipisend(cpu, IPI_RESCHED);
+}
+
+// Run fn(arg) on cpu, with interrupts off there, and wait
+// for it to return.
+void
+ipi_call(int cpu, void (*fn)(void*), void *arg)
+{
+  ipisync(cpu, IPI_CALL, fn, arg);
+}
+
+// Run fn(arg) on every started CPU, this one included.
+void
+ipi_callall(void (*fn)(void*), void *arg)
+{
+  for(int i = 0; i < ncpu; i++)
+    ipisync(i, IPI_CALL, fn, arg);
+}
+
+// Flush the TLB of every CPU that may hold entries of
+// pagetable: every CPU for the kernel's (pagetable 0), or
+// else those running a thread that uses it. A CPU that
+// switches to pagetable later flushes in userret. The look
+// at each CPU's process is unlocked; at worst it flushes a
+// CPU that didn't need it.
+void
+tlbshootdown(pagetable_t pagetable)
+{
+  struct cpu *c;
+  struct proc *p;
+  struct mm *mm;
+
+  for(int i = 0; i < ncpu; i++){
+    c = &cpus[i];
+    p = c->proc;
+    mm = p ? p->mm : 0;
+    if(pagetable == 0 || (mm && mm->pagetable == pagetable))
+      ipisync(i, IPI_TLB, 0, 0);
+  }
+}
+
+// Report the IPIs each CPU has received, by type.
+int
+ipistats(char *buf, int sz)
+{
+  int n = 0;
+
+  for(int i = 0; i < ncpu; i++){
+    n += snprintf(buf+n, sz-n, "ipi: cpu %d", i);
+    for(int t = 0; t < NIPI; t++)
+      n += snprintf(buf+n, sz-n, " %s %ld", names[t], ipis[i].n[t]);
+    n += snprintf(buf+n, sz-n, "\n");
+  }
+  return n;
+}
@@ -1,6 +1,28 @@
 // Physical memory allocator, for user processes,
 // kernel stacks, page-table pages,
-// and pipe buffers. Allocates whole 4096-byte pages.
+// and pipe buffers. Allocates 4096-byte pages, or
+// naturally aligned blocks of 2^order pages.
+//
+// Free memory lives in a buddy allocator: one free list per
+// order, where a freed block merges with its buddy (the other
+// half of the block of the next order) whenever that buddy is
+// free too.
+//
+// Each CPU keeps its own cache of free single pages in front
+// of the buddy allocator, so kalloc() and kfree() normally
+// touch only that CPU's lock. A cache holds at most KCACHE_MAX
+// pages; beyond that, kfree() spills a batch back to the buddy
+// allocator. An empty cache refills a batch from the buddy
+// allocator, or, if that is empty too, steals a batch from
+// another CPU's cache.
+//
+// Idle CPUs keep a pool of pages that are already zeroed,
+// for kalloc_zeroed(). A kalloc() that finds nothing else
+// takes from this pool too.
+//
+// If KPOISON (a Makefile option) is non-zero, freed and newly
+// allocated pages are filled with junk to catch dangling refs
+// and use of uninitialized memory.
 
 #include "types.h"
 #include "param.h"
@@ -9,57 +31,387 @@
 #include "riscv.h"
 #include "defs.h"
 
+#define KCACHE_MAX   64  // max pages in a CPU's cache
+#define KCACHE_BATCH 32  // pages moved per refill, spill, or steal
+#define NORDER       11  // block orders 0 (4 KiB) to NORDER-1 (4 MiB)
+#define KZERO_MAX   128  // max pages in the zeroed pool
+#define KZERO_BATCH   8  // pages an idle CPU zeroes at a time
+
 void freerange(void *pa_start, void *pa_end);
 
 extern char end[]; // first address after kernel.
                    // defined by kernel.ld.
 
+#define NPAGE ((PHYSTOP - KERNBASE) / PGSIZE)
+#define PA2PG(pa) (((uint64)(pa) - KERNBASE) / PGSIZE)
+
+// The order of the allocated block each page belongs to, or,
+// for the first page of a block on a buddy free list, its
+// order | KFREE.
+#define KFREE 0x80
+static uchar kstate[NPAGE];
+
+// Number of page tables (and kernel users) referring to
+// each allocated page or block, kept at its first page, so
+// that fork can share pages copy-on-write. A page or block is
+// freed when its count drops to 0. ksplit() breaks a block
+// into single pages, each with its own count. Counts of
+// blocks change under buddy.lock, so as not to race with
+// ksplit(); counts of single pages atomically.
+static int kref[NPAGE];
+
 struct run {
   struct run *next;
+  struct run *prev;  // only on buddy free lists
 };
 
-struct {
+struct kmem {
   struct spinlock lock;
   struct run *freelist;
-} kmem;
+  int nfree;
+};
+
+struct {
+  struct spinlock lock;
+  struct run *freelist[NORDER];
+  int nfree[NORDER];
+} buddy;
+
+struct kmem kcache[NCPU];   // per-CPU caches
+uint64 ksteals;             // batches stolen from another CPU
+
+struct kmem kzero;          // zeroed pages, allocated but unused
+uint64 kzerohits;           // kalloc_zeroed() calls the pool served
+uint64 kzeromisses;         // ... and calls that had to zero a page
+
+static void bpush(struct run *r, int order);
 
 void
 kinit()
 {
-  initlock(&kmem.lock, "kmem");
+  initlock(&buddy.lock, "buddy");
+  initlock(&kzero.lock, "kzero");
+  for(int i = 0; i < NCPU; i++)
+    initlock(&kcache[i].lock, "kcache");
   freerange(end, (void*)PHYSTOP);
 }
 
+// Give [pa_start, pa_end) to the buddy allocator as the
+// largest aligned blocks that fit. Only used when booting.
 void
 freerange(void *pa_start, void *pa_end)
 {
-  char *p;
-  p = (char*)PGROUNDUP((uint64)pa_start);
-  for(; p + PGSIZE <= (char*)pa_end; p += PGSIZE)
-    kfree(p);
+  uint64 p;
+  int order;
+
+  p = PGROUNDUP((uint64)pa_start);
+  while(p + PGSIZE <= (uint64)pa_end){
+    for(order = NORDER-1; order > 0; order--){
+      if(p % (PGSIZE << order) == 0 && p + (PGSIZE << order) <= (uint64)pa_end)
+        break;
+    }
+    bpush((struct run*)p, order);
+    p += PGSIZE << order;
+  }
+}
+
+// Put the free block r of 2^order pages on its free list.
+// Caller must hold buddy.lock.
+static void
+bpush(struct run *r, int order)
+{
+  r->prev = 0;
+  r->next = buddy.freelist[order];
+  if(r->next)
+    r->next->prev = r;
+  buddy.freelist[order] = r;
+  buddy.nfree[order]++;
+  kstate[PA2PG(r)] = order | KFREE;
+}
+
+// Take the free block r of 2^order pages off its free list.
+// Caller must hold buddy.lock.
+static void
+bunlink(struct run *r, int order)
+{
+  if(r->prev)
+    r->prev->next = r->next;
+  else
+    buddy.freelist[order] = r->next;
+  if(r->next)
+    r->next->prev = r->prev;
+  buddy.nfree[order]--;
+  kstate[PA2PG(r)] = 0;
+}
+
+// Allocate a block of 2^order pages, splitting a larger
+// block if need be, and mark its pages as belonging to it.
+// Caller must hold buddy.lock. Returns 0 if none is free.
+static struct run*
+balloc(int order)
+{
+  struct run *r;
+  int k;
+
+  for(k = order; k < NORDER && buddy.freelist[k] == 0; k++)
+    ;
+  if(k == NORDER)
+    return 0;
+  r = buddy.freelist[k];
+  bunlink(r, k);
+  // give back the upper half at each order on the way down.
+  while(k > order){
+    k--;
+    bpush((struct run*)((char*)r + (PGSIZE << k)), k);
+  }
+  if(order > 0)
+    memset(&kstate[PA2PG(r)], order, 1 << order);
+  return r;
+}
+
+// Free the block r of 2^order pages, merging it with
+// its buddy for as long as the buddy is free too.
+// Caller must hold buddy.lock.
+static void
+bfree(struct run *r, int order)
+{
+  uint64 pa, bpa;
+
+  pa = (uint64)r;
+  while(order < NORDER-1){
+    bpa = KERNBASE + ((pa - KERNBASE) ^ (PGSIZE << order));
+    if(bpa < (uint64)end || bpa >= PHYSTOP)
+      break;
+    if(kstate[PA2PG(bpa)] != (order | KFREE))
+      break;
+    bunlink((struct run*)bpa, order);
+    if(bpa < pa)
+      pa = bpa;
+    order++;
+  }
+  bpush((struct run*)pa, order);
+}
+
+// Detach up to n pages from the front of k's free list.
+// Caller must hold k->lock.
+// Returns the detached list and sets *tail and *got.
+static struct run*
+takebatch(struct kmem *k, int n, struct run **tail, int *got)
+{
+  struct run *head, *r;
+  int i;
+
+  head = k->freelist;
+  if(head == 0){
+    *got = 0;
+    return 0;
+  }
+  r = head;
+  for(i = 1; i < n && r->next; i++)
+    r = r->next;
+  k->freelist = r->next;
+  k->nfree -= i;
+  r->next = 0;
+  *tail = r;
+  *got = i;
+  return head;
+}
+
+// Push a list of n pages onto k's free list.
+// Caller must hold k->lock.
+static void
+putbatch(struct kmem *k, struct run *head, struct run *tail, int n)
+{
+  tail->next = k->freelist;
+  k->freelist = head;
+  k->nfree += n;
+}
+
+// Give a list of single pages back to the buddy allocator.
+static void
+bputlist(struct run *head)
+{
+  struct run *r;
+
+  acquire(&buddy.lock);
+  while((r = head) != 0){
+    head = r->next;
+    bfree(r, 0);
+  }
+  release(&buddy.lock);
+}
+
+// Refill CPU cache c, which is empty, from the buddy
+// allocator or from another CPU, and return one page from
+// the batch. Returns 0 if no free page is left anywhere.
+// Interrupts must be disabled.
+static struct run*
+krefill(struct kmem *c)
+{
+  struct run *head, *tail, *r;
+  int got, i, id;
+
+  head = tail = 0;
+  acquire(&buddy.lock);
+  for(got = 0; got < KCACHE_BATCH && (r = balloc(0)) != 0; got++){
+    r->next = head;
+    head = r;
+    if(tail == 0)
+      tail = r;
+  }
+  release(&buddy.lock);
+
+  id = c - kcache;
+  for(i = 1; head == 0 && i < NCPU; i++){
+    struct kmem *v = &kcache[(id + i) % NCPU];
+    acquire(&v->lock);
+    head = takebatch(v, KCACHE_BATCH, &tail, &got);
+    release(&v->lock);
+    if(head)
+      __sync_fetch_and_add(&ksteals, 1);
+  }
+
+  if(head == 0)
+    return 0;
+  if(got > 1){
+    acquire(&c->lock);
+    putbatch(c, head->next, tail, got - 1);
+    release(&c->lock);
+  }
+  return head;
 }
 
-// Free the page of physical memory pointed at by pa,
-// which normally should have been returned by a
-// call to kalloc().  (The exception is when
-// initializing the allocator; see kinit above.)
+// Give every CPU's cached pages back to the buddy
+// allocator, so that they can merge into larger blocks.
+static void
+kdrain(void)
+{
+  struct run *head, *tail;
+  int got;
+
+  for(int i = 0; i < NCPU; i++){
+    acquire(&kcache[i].lock);
+    head = takebatch(&kcache[i], kcache[i].nfree, &tail, &got);
+    release(&kcache[i].lock);
+    bputlist(head);
+  }
+}
+
+// Take a page from the zeroed pool, or return 0.
+// The page is allocated already.
+static void*
+kzeropop(void)
+{
+  struct run *r;
+
+  acquire(&kzero.lock);
+  if((r = kzero.freelist) != 0){
+    kzero.freelist = r->next;
+    kzero.nfree--;
+  }
+  release(&kzero.lock);
+  if(r)
+    r->next = 0;  // the only non-zero word
+  return (void*)r;
+}
+
+// Free every page in the zeroed pool.
+static void
+kzerodrain(void)
+{
+  void *pa;
+
+  while((pa = kzeropop()) != 0)
+    kfree(pa);
+}
+
+// Drop a reference to the page of physical memory at pa,
+// which normally should have been returned by a call to
+// kalloc(), or be a page of a block that ksplit() broke up.
+// The page is freed when the last reference goes away.
 void
 kfree(void *pa)
 {
-  struct run *r;
+  struct run *r, *head, *tail;
+  struct kmem *c;
+  int got, ref;
 
   if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
     panic("kfree");
+  if(kstate[PA2PG(pa)] != 0)
+    panic("kfree: not a single page");
 
-  // Fill with junk to catch dangling refs.
-  memset(pa, 1, PGSIZE);
+  if((ref = __sync_sub_and_fetch(&kref[PA2PG(pa)], 1)) > 0)
+    return;
+  if(ref < 0)
+    panic("kfree: ref");
 
   r = (struct run*)pa;
+#if KPOISON
+  // Fill with junk to catch dangling refs.
+  memset(r, 1, PGSIZE);
+#endif
+
+  push_off();
+  c = &kcache[cpuid()];
+  acquire(&c->lock);
+  r->next = c->freelist;
+  c->freelist = r;
+  c->nfree++;
+  head = 0;
+  if(c->nfree > KCACHE_MAX)
+    head = takebatch(c, KCACHE_BATCH, &tail, &got);
+  release(&c->lock);
+  pop_off();
+
+  if(head)
+    bputlist(head);
+}
+
+// Lock the block of 2^order pages at pa, which
+// kalloc_order(order) returned, and return 1; or, if
+// ksplit() has broken it into single pages, return 0
+// without locking anything.
+static int
+kblocklock(void *pa, int order)
+{
+  if(((uint64)pa % (PGSIZE << order)) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
+    panic("kblocklock");
+  acquire(&buddy.lock);
+  if(kstate[PA2PG(pa)] == 0){
+    release(&buddy.lock);
+    return 0;
+  }
+  if(kstate[PA2PG(pa)] != order)
+    panic("kblocklock: order");
+  return 1;
+}
 
-  acquire(&kmem.lock);
-  r->next = kmem.freelist;
-  kmem.freelist = r;
-  release(&kmem.lock);
+// Drop a reference to the 2^order pages at pa, which
+// kalloc_order(order) returned: the block's reference, or,
+// if ksplit() has broken it up, each page's.
+void
+kfree_order(void *pa, int order)
+{
+  int ref;
+
+  if(order == 0 || !kblocklock(pa, order)){
+    for(int i = 0; i < (1 << order); i++)
+      kfree((char*)pa + i*PGSIZE);
+    return;
+  }
+  if((ref = --kref[PA2PG(pa)]) < 0)
+    panic("kfree_order: ref");
+  release(&buddy.lock);
+  if(ref > 0)
+    return;
+
+#if KPOISON
+  memset(pa, 1, PGSIZE << order);
+#endif
+  acquire(&buddy.lock);
+  bfree((struct run*)pa, order);
+  release(&buddy.lock);
 }
 
 // Allocate one 4096-byte page of physical memory.
@@ -69,14 +421,209 @@ void *
 kalloc(void)
 {
   struct run *r;
+  struct kmem *c;
 
-  acquire(&kmem.lock);
-  r = kmem.freelist;
-  if(r)
-    kmem.freelist = r->next;
-  release(&kmem.lock);
+  push_off();
+  c = &kcache[cpuid()];
+  acquire(&c->lock);
+  r = c->freelist;
+  if(r){
+    c->freelist = r->next;
+    c->nfree--;
+  }
+  release(&c->lock);
+  if(r == 0)
+    r = krefill(c);
+  pop_off();
 
-  if(r)
-    memset((char*)r, 5, PGSIZE); // fill with junk
+  if(r == 0){
+    if((r = kzeropop()) != 0)
+      return (void*)r;
+    if(slabreclaim() > 0)
+      return kalloc();
+    return 0;
+  }
+
+  kref[PA2PG(r)] = 1;
+#if KPOISON
+  memset((char*)r, 5, PGSIZE); // fill with junk
+#endif
   return (void*)r;
 }
+
+// Allocate one zeroed 4096-byte page, preferably one
+// that an idle CPU has zeroed already.
+// Returns 0 if the memory cannot be allocated.
+void *
+kalloc_zeroed(void)
+{
+  void *pa;
+
+  if((pa = kzeropop()) != 0){
+    __sync_fetch_and_add(&kzerohits, 1);
+    return pa;
+  }
+  __sync_fetch_and_add(&kzeromisses, 1);
+  if((pa = kalloc()) != 0)
+    memset(pa, 0, PGSIZE);
+  return pa;
+}
+
+// Called by a CPU with nothing to run: zero a few free
+// pages for kalloc_zeroed(). Only takes pages the buddy
+// allocator has to spare, never the CPUs' cached ones.
+void
+kzerofill(void)
+{
+  struct run *r;
+
+  for(int i = 0; i < KZERO_BATCH && kzero.nfree < KZERO_MAX; i++){
+    acquire(&buddy.lock);
+    r = balloc(0);
+    release(&buddy.lock);
+    if(r == 0)
+      return;
+    kref[PA2PG(r)] = 1;
+    memset(r, 0, PGSIZE);
+
+    acquire(&kzero.lock);
+    r->next = kzero.freelist;
+    kzero.freelist = r;
+    kzero.nfree++;
+    release(&kzero.lock);
+  }
+}
+
+// Allocate a physically contiguous block of 2^order pages,
+// aligned to its size. The block has one reference count,
+// for kdup_order() and kfree_order(), until ksplit().
+// Returns 0 if the memory cannot be allocated.
+void *
+kalloc_order(int order)
+{
+  struct run *r;
+
+  if(order < 0 || order >= NORDER)
+    return 0;
+  if(order == 0)
+    return kalloc();
+
+  acquire(&buddy.lock);
+  r = balloc(order);
+  release(&buddy.lock);
+  if(r == 0){
+    // pages sitting in CPU caches, the zeroed pool, or
+    // unused slabs may complete a block.
+    slabreclaim();
+    kzerodrain();
+    kdrain();
+    acquire(&buddy.lock);
+    r = balloc(order);
+    release(&buddy.lock);
+  }
+
+  if(r){
+    kref[PA2PG(r)] = 1;
+#if KPOISON
+    memset((char*)r, 5, PGSIZE << order); // fill with junk
+#endif
+  }
+  return (void*)r;
+}
+
+// Add a reference to the allocated page at pa.
+void
+kdup(void *pa)
+{
+  if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
+    panic("kdup");
+  if(kstate[PA2PG(pa)] != 0)
+    panic("kdup: not a single page");
+  if(__sync_fetch_and_add(&kref[PA2PG(pa)], 1) < 1)
+    panic("kdup: free page");
+}
+
+// Add a reference to the 2^order pages at pa, as
+// kfree_order() drops one.
+void
+kdup_order(void *pa, int order)
+{
+  if(order == 0 || !kblocklock(pa, order)){
+    for(int i = 0; i < (1 << order); i++)
+      kdup((char*)pa + i*PGSIZE);
+    return;
+  }
+  if(kref[PA2PG(pa)]++ < 1)
+    panic("kdup_order: free block");
+  release(&buddy.lock);
+}
+
+// Break the block of 2^order pages at pa, which
+// kalloc_order(order) returned, into single pages that
+// are freed one by one. Each page starts with the block's
+// references, since every holder of the block holds it.
+// Does nothing if the block is broken up already.
+void
+ksplit(void *pa, int order)
+{
+  int ref, pg;
+
+  if(order == 0 || !kblocklock(pa, order))
+    return;
+  pg = PA2PG(pa);
+  ref = kref[pg];
+  for(int i = 0; i < (1 << order); i++){
+    kstate[pg + i] = 0;
+    kref[pg + i] = ref;
+  }
+  release(&buddy.lock);
+}
+
+// Return the number of references to the 2^order pages
+// at pa: the block's, or, if ksplit() broke it up, the
+// most that any one page has.
+int
+krefcount(void *pa, int order)
+{
+  int ref = 0;
+
+  if(order > 0 && kblocklock(pa, order)){
+    ref = kref[PA2PG(pa)];
+    release(&buddy.lock);
+    return ref;
+  }
+  for(int i = 0; i < (1 << order); i++){
+    if(kref[PA2PG(pa) + i] > ref)
+      ref = kref[PA2PG(pa) + i];
+  }
+  return ref;
+}
+
+// Report free blocks by order, which shows how fragmented
+// free memory is, and how often CPUs steal.
+int
+kallocstats(char *buf, int sz)
+{
+  int n, k, largest, pages;
+
+  acquire(&buddy.lock);
+  n = snprintf(buf, sz, "kalloc: buddy free blocks by order");
+  largest = -1;
+  pages = 0;
+  for(k = 0; k < NORDER; k++){
+    n += snprintf(buf+n, sz-n, " %d", buddy.nfree[k]);
+    if(buddy.nfree[k])
+      largest = k;
+    pages += buddy.nfree[k] << k;
+  }
+  release(&buddy.lock);
+  n += snprintf(buf+n, sz-n, "\nkalloc: %d pages free in buddy, largest order %d\n",
+                pages, largest);
+
+  n += snprintf(buf+n, sz-n, "kalloc: %ld steals, cpu cache", ksteals);
+  for(int i = 0; i < NCPU; i++)
+    n += snprintf(buf+n, sz-n, " %d", kcache[i].nfree);
+  n += snprintf(buf+n, sz-n, "\nkalloc: %d zeroed pages ready, %ld hits, %ld misses\n",
+                kzero.nfree, kzerohits, kzeromisses);
+  return n;
+}
@@ -123,18 +123,22 @@ recover_from_log(void)
 }
 
 // called at the start of each FS system call.
+// waiters are woken one at a time; each one that gets in
+// wakes the next if there is room for it too.
 void
 begin_op(void)
 {
   acquire(&log.lock);
   while(1){
     if(log.committing){
-      sleep(&log, &log.lock);
+      sleep_excl(&log, &log.lock);
     } else if(log.lh.n + (log.outstanding+1)*MAXOPBLOCKS > LOGSIZE){
       // this op might exhaust log space; wait for commit.
-      sleep(&log, &log.lock);
+      sleep_excl(&log, &log.lock);
     } else {
       log.outstanding += 1;
+      if(log.lh.n + (log.outstanding+1)*MAXOPBLOCKS <= LOGSIZE)
+        wakeupn(&log, 1);
       release(&log.lock);
       break;
     }
@@ -159,7 +163,7 @@ end_op(void)
     // begin_op() may be waiting for log space,
     // and decrementing log.outstanding has decreased
     // the amount of reserved space.
-    wakeup(&log);
+    wakeupn(&log, 1);
   }
   release(&log.lock);
 
@@ -169,7 +173,7 @@ end_op(void)
     commit();
     acquire(&log.lock);
     log.committing = 0;
-    wakeup(&log);
+    wakeupn(&log, 1);
     release(&log.lock);
   }
 }
@@ -2,6 +2,8 @@
 #include "param.h"
 #include "memlayout.h"
 #include "riscv.h"
+#include "spinlock.h"
+#include "proc.h"
 #include "defs.h"
 
 volatile static int started = 0;
@@ -27,8 +29,11 @@ main()
     binit();         // buffer cache
     iinit();         // inode table
     fileinit();      // file table
+    pipeinit();      // pipe cache
+    statsinit();     // statistics device
     virtio_disk_init(); // emulated hard disk
     userinit();      // first user process
+    __sync_fetch_and_add(&ncpu, 1);
     __sync_synchronize();
     started = 1;
   } else {
@@ -39,6 +44,7 @@ main()
     kvminithart();    // turn on paging
     trapinithart();   // install kernel trap vector
     plicinithart();   // ask PLIC for device interrupts
+    __sync_fetch_and_add(&ncpu, 1);
   }
 
   scheduler();        
@@ -27,8 +27,11 @@
 
 // core local interruptor (CLINT), which contains the timer.
 #define CLINT 0x2000000L
+#define CLINT_MSIP(hartid) (CLINT + 4*(hartid)) // software interrupt
 #define CLINT_MTIMECMP(hartid) (CLINT + 0x4000 + 8*(hartid))
 #define CLINT_MTIME (CLINT + 0xBFF8) // cycles since boot.
+#define CLINT_HZ 10000000            // CLINT_MTIME cycles per second
+#define TICKCYCLES (CLINT_HZ / HZ)   // CLINT_MTIME cycles per timer tick
 
 // qemu puts platform-level interrupt controller (PLIC) here.
 #define PLIC 0x0c000000L
@@ -52,7 +55,9 @@
 #define TRAMPOLINE (MAXVA - PGSIZE)
 
 // map kernel stacks beneath the trampoline,
-// each surrounded by invalid guard pages.
+// each surrounded by invalid guard pages. A stack is
+// mapped when its struct proc is first used, and stays
+// mapped while the proc is free until proctrim() in proc.c.
 #define KSTACK(p) (TRAMPOLINE - ((p)+1)* 2*PGSIZE)
 
 // User memory layout.
@@ -62,6 +67,15 @@
 //   fixed-size stack
 //   expandable heap
 //   ...
+//   mmap() regions
+//   other threads' trapframes
 //   TRAPFRAME (p->trapframe, used by the trampoline)
 //   TRAMPOLINE (the same page as in the kernel)
 #define TRAPFRAME (TRAMPOLINE - PGSIZE)
+
+// each thread of a process has its own trapframe page,
+// thread slot i's at THREADFRAME(i); see thread.c.
+#define THREADFRAME(i) (TRAPFRAME - (i)*PGSIZE)
+
+// the top of the memory a user program may use.
+#define USERTOP THREADFRAME(NTHREAD-1)
@@ -1,8 +1,13 @@
-#define NPROC        64  // maximum number of processes
+#ifndef NPROC
+#define NPROC       256  // maximum number of processes; see the Makefile
+#endif
+#define NWAITQ       64  // wait queues, hashed by channel
+#define NPIDHASH     64  // pid hash table chains
+#define NTHREAD      16  // maximum threads per process
 #define NCPU          8  // maximum number of CPUs
 #define NOFILE       16  // open files per process
-#define NFILE       100  // open files per system
-#define NINODE       50  // maximum number of active i-nodes
+#define NVMA         16  // memory regions per process
+#define NINODE       50  // i-nodes kept cached in memory
 #define NDEV         10  // maximum major device number
 #define ROOTDEV       1  // device number of file system root disk
 #define MAXARG       32  // max exec arguments
@@ -11,3 +16,8 @@
 #define NBUF         (MAXOPBLOCKS*3)  // size of disk block cache
 #define FSSIZE       2000  // size of file system in blocks
 #define MAXPATH      128   // maximum file path name
+#define NICE_MIN     -20   // most favoured nice value
+#define NICE_MAX      19   // least favoured nice value
+#ifndef HZ
+#define HZ            10   // timer ticks per second; see the Makefile
+#endif
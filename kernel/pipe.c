@@ -7,6 +7,8 @@
 #include "fs.h"
 #include "sleeplock.h"
 #include "file.h"
+#include "fcntl.h"
+#include "slab.h"
 
 #define PIPESIZE 512
 
@@ -19,6 +21,14 @@ struct pipe {
   int writeopen;  // write fd is still open
 };
 
+struct kmem_cache pipecache;
+
+void
+pipeinit(void)
+{
+  kmem_cache_init(&pipecache, "pipe", sizeof(struct pipe));
+}
+
 int
 pipealloc(struct file **f0, struct file **f1)
 {
@@ -28,7 +38,7 @@ pipealloc(struct file **f0, struct file **f1)
   *f0 = *f1 = 0;
   if((*f0 = filealloc()) == 0 || (*f1 = filealloc()) == 0)
     goto bad;
-  if((pi = (struct pipe*)kalloc()) == 0)
+  if((pi = kmem_cache_alloc(&pipecache)) == 0)
     goto bad;
   pi->readopen = 1;
   pi->writeopen = 1;
@@ -47,7 +57,7 @@ pipealloc(struct file **f0, struct file **f1)
 
  bad:
   if(pi)
-    kfree((char*)pi);
+    kmem_cache_free(&pipecache, pi);
   if(*f0)
     fileclose(*f0);
   if(*f1)
@@ -68,13 +78,16 @@ pipeclose(struct pipe *pi, int writable)
   }
   if(pi->readopen == 0 && pi->writeopen == 0){
     release(&pi->lock);
-    kfree((char*)pi);
+    kmem_cache_free(&pipecache, pi);
   } else
     release(&pi->lock);
+  pollwakeup();
 }
 
+// Write n bytes from user address addr. If nonblock, write
+// only what fits without waiting, and return -1 if nothing does.
 int
-pipewrite(struct pipe *pi, uint64 addr, int n)
+pipewrite(struct pipe *pi, uint64 addr, int n, int nonblock)
 {
   int i = 0;
   struct proc *pr = myproc();
@@ -82,28 +95,43 @@ pipewrite(struct pipe *pi, uint64 addr, int n)
   acquire(&pi->lock);
   while(i < n){
     if(pi->readopen == 0 || killed(pr)){
+      // pass on a wakeup this writer may have been given.
+      wakeupn(&pi->nwrite, 1);
       release(&pi->lock);
       return -1;
     }
     if(pi->nwrite == pi->nread + PIPESIZE){ //DOC: pipewrite-full
-      wakeup(&pi->nread);
-      sleep(&pi->nwrite, &pi->lock);
+      if(nonblock){
+        if(i > 0)
+          break;
+        release(&pi->lock);
+        return -1;
+      }
+      wakeupn(&pi->nread, 1);
+      sleep_excl(&pi->nwrite, &pi->lock);
     } else {
       char ch;
-      if(copyin(pr->pagetable, &ch, addr + i, 1) == -1)
+      if(copyin_locked(pr->mm->pagetable, &ch, addr + i, 1) == -1)
         break;
       pi->data[pi->nwrite++ % PIPESIZE] = ch;
       i++;
     }
   }
-  wakeup(&pi->nread);
+  // readers and writers are woken one at a time, and each
+  // wakes the next if there is still something for it.
+  wakeupn(&pi->nread, 1);
+  if(pi->nwrite != pi->nread + PIPESIZE)
+    wakeupn(&pi->nwrite, 1);
   release(&pi->lock);
+  pollwakeup();
 
   return i;
 }
 
+// Read up to n bytes to user address addr. If nonblock,
+// return -1 rather than wait for data.
 int
-piperead(struct pipe *pi, uint64 addr, int n)
+piperead(struct pipe *pi, uint64 addr, int n, int nonblock)
 {
   int i;
   struct proc *pr = myproc();
@@ -111,20 +139,45 @@ piperead(struct pipe *pi, uint64 addr, int n)
 
   acquire(&pi->lock);
   while(pi->nread == pi->nwrite && pi->writeopen){  //DOC: pipe-empty
+    if(nonblock){
+      release(&pi->lock);
+      return -1;
+    }
     if(killed(pr)){
+      wakeupn(&pi->nread, 1);
       release(&pi->lock);
       return -1;
     }
-    sleep(&pi->nread, &pi->lock); //DOC: piperead-sleep
+    sleep_excl(&pi->nread, &pi->lock); //DOC: piperead-sleep
   }
   for(i = 0; i < n; i++){  //DOC: piperead-copy
     if(pi->nread == pi->nwrite)
       break;
     ch = pi->data[pi->nread++ % PIPESIZE];
-    if(copyout(pr->pagetable, addr + i, &ch, 1) == -1)
+    if(copyout_locked(pr->mm->pagetable, addr + i, &ch, 1) == -1)
       break;
   }
-  wakeup(&pi->nwrite);  //DOC: piperead-wakeup
+  wakeupn(&pi->nwrite, 1);  //DOC: piperead-wakeup
+  if(pi->nread != pi->nwrite)
+    wakeupn(&pi->nread, 1);
   release(&pi->lock);
+  pollwakeup();
   return i;
 }
+
+// Which of events a read or write of pi wouldn't wait
+// for: there is data or no writer left (POLLIN), or room
+// or no reader left (POLLOUT).
+int
+pipepoll(struct pipe *pi, int events)
+{
+  int r = 0;
+
+  acquire(&pi->lock);
+  if(pi->nread != pi->nwrite || !pi->writeopen)
+    r |= POLLIN;
+  if(pi->nwrite != pi->nread + PIPESIZE || !pi->readopen)
+    r |= POLLOUT;
+  release(&pi->lock);
+  return r & events;
+}
@@ -4,16 +4,44 @@
 #include "riscv.h"
 #include "spinlock.h"
 #include "proc.h"
+#include "slab.h"
 #include "defs.h"
 
 struct cpu cpus[NCPU];
-
-struct proc proc[NPROC];
+int ncpu;
+
+// struct procs are allocated as needed, up to NPROC, and
+// never freed: an UNUSED one goes on a free list for reuse.
+// So a struct proc found by an unlocked lookup stays a
+// struct proc, and its lock can be taken to see whether it
+// is the process wanted. procs[] records each struct proc
+// allocated, and its index there picks its KSTACK() slot.
+//
+// A freed proc keeps its kernel stack mapped, ready for
+// the next fork(). Once more than 2*NFREESTACK free procs
+// have stacks, proctrim() unmaps all but NFREESTACK of
+// them, with one TLB flush for the lot.
+#define NFREESTACK 16
+
+struct kmem_cache proccache;
+static struct proc *procs[NPROC];
+static int nprocs;          // entries in procs[]
+static int nused;           // procs not UNUSED
+static int peak;            // most procs ever in use at once
 
 struct proc *initproc;
 
 int nextpid = 1;
+
+// pid_lock protects nextpid, the hash table of procs by pid,
+// the lists of UNUSED procs, which are chained through
+// p->pidnext, and the additions to procs[] and the counts.
+// Locking: p->lock before pid_lock.
 struct spinlock pid_lock;
+static struct proc *pidhash[NPIDHASH];
+static struct proc *freeprocs;  // kernel stack still mapped
+static struct proc *bareprocs;  // kernel stack unmapped
+static int nfree;               // procs on freeprocs
 
 extern void forkret(void);
 static void freeproc(struct proc *p);
@@ -22,40 +50,44 @@ extern char trampoline[]; // trampoline.S
 
 // helps ensure that wakeups of wait()ing
 // parents are not lost. helps obey the
-// memory model when using p->parent.
+// memory model when using p->parent and
+// the lists of children.
 // must be acquired before any p->lock.
 struct spinlock wait_lock;
 
-// Allocate a page for each process's kernel stack.
-// Map it high in memory, followed by an invalid
-// guard page.
-void
-proc_mapstacks(pagetable_t kpgtbl)
-{
-  struct proc *p;
-  
-  for(p = proc; p < &proc[NPROC]; p++) {
-    char *pa = kalloc();
-    if(pa == 0)
-      panic("kalloc");
-    uint64 va = KSTACK((int) (p - proc));
-    kvmmap(kpgtbl, va, (uint64)pa, PGSIZE, PTE_R | PTE_W);
-  }
-}
+// Sleeping processes wait on a queue chosen by hashing
+// the channel, so wakeup() looks only at processes that
+// may be sleeping on it. An exclusive sleeper (sleep_excl())
+// goes at the tail, and wakeupn() wakes only so many of
+// those, for when one waiter can use up what the waker
+// has to give, so that the rest would only go back to sleep.
+//
+// Locking: the caller's lock before a queue's lock before
+// p->lock. A process stays on its queue until it is woken
+// by wakeup(), or, if something else woke it (kill(), say),
+// until it takes itself off in sleep().
+struct waitq {
+  struct spinlock lock;
+  struct proc *head;
+  struct proc *tail;
+};
+
+static struct waitq waitqs[NWAITQ];
 
 // initialize the proc table.
 void
 procinit(void)
 {
-  struct proc *p;
-  
   initlock(&pid_lock, "nextpid");
   initlock(&wait_lock, "wait_lock");
-  for(p = proc; p < &proc[NPROC]; p++) {
-      initlock(&p->lock, "proc");
-      p->state = UNUSED;
-      p->kstack = KSTACK((int) (p - proc));
-  }
+  for(int i = 0; i < NWAITQ; i++)
+    initlock(&waitqs[i].lock, "waitq");
+  kmem_cache_init(&proccache, "proc", sizeof(struct proc));
+  runqinit();
+  edfinit();
+  futexinit();
+  wheelinit();
+  threadinit();
 }
 
 // Must be called with interrupts disabled,
@@ -89,52 +121,139 @@ myproc(void)
   return p;
 }
 
-int
-allocpid()
+// Return the i'th struct proc allocated, or 0 if there
+// aren't that many. For looking at every process: take
+// p->lock and skip those that are UNUSED.
+struct proc*
+procat(int i)
 {
-  int pid;
-  
+  if(i < 0 || i >= __atomic_load_n(&nprocs, __ATOMIC_ACQUIRE))
+    return 0;
+  return procs[i];
+}
+
+// Allocate and enter a new struct proc in procs[], if there
+// are fewer than NPROC. Returns it UNUSED, with no kernel
+// stack, or 0.
+static struct proc*
+procgrow(void)
+{
+  struct proc *p;
+
+  if((p = kmem_cache_alloc(&proccache)) == 0)
+    return 0;
+  memset(p, 0, sizeof(*p));
+  initlock(&p->lock, "proc");
+  p->state = UNUSED;
+  p->timer.cpu = -1;
+
   acquire(&pid_lock);
-  pid = nextpid;
+  if(nprocs == NPROC){
+    release(&pid_lock);
+    kmem_cache_free(&proccache, p);
+    return 0;
+  }
+  p->kstack = KSTACK(nprocs);
+  procs[nprocs] = p;
+  __atomic_store_n(&nprocs, nprocs + 1, __ATOMIC_RELEASE);
+  release(&pid_lock);
+  return p;
+}
+
+// Give p a new pid, and enter it in the pid hash table.
+static void
+allocpid(struct proc *p)
+{
+  struct proc **h;
+
+  acquire(&pid_lock);
+  p->pid = nextpid;
   nextpid = nextpid + 1;
+  h = &pidhash[p->pid % NPIDHASH];
+  p->pidnext = *h;
+  *h = p;
+  if(++nused > peak)
+    peak = nused;
   release(&pid_lock);
+}
 
-  return pid;
+// Return the proc with the given pid, with p->lock held,
+// or 0 if there is none.
+static struct proc*
+pidlookup(int pid)
+{
+  struct proc *p;
+
+  if(pid <= 0)
+    return 0;
+  acquire(&pid_lock);
+  for(p = pidhash[pid % NPIDHASH]; p; p = p->pidnext){
+    if(p->pid == pid)
+      break;
+  }
+  release(&pid_lock);
+  if(p == 0)
+    return 0;
+  // it may have been freed meanwhile, though struct
+  // procs are never freed to the allocator.
+  acquire(&p->lock);
+  if(p->pid != pid || p->state == UNUSED){
+    release(&p->lock);
+    return 0;
+  }
+  return p;
 }
 
-// Look in the process table for an UNUSED proc.
-// If found, initialize state required to run in the kernel,
+// Take an UNUSED proc off a free list, or allocate a new
+// one if there are fewer than NPROC.
+// If there is one, initialize state required to run in the kernel,
 // and return with p->lock held.
 // If there are no free procs, or a memory allocation fails, return 0.
 static struct proc*
 allocproc(void)
 {
   struct proc *p;
+  int mapped = 0;
 
-  for(p = proc; p < &proc[NPROC]; p++) {
-    acquire(&p->lock);
-    if(p->state == UNUSED) {
-      goto found;
-    } else {
-      release(&p->lock);
-    }
+  // prefer one whose kernel stack is still mapped.
+  acquire(&pid_lock);
+  if((p = freeprocs) != 0){
+    freeprocs = p->pidnext;
+    nfree--;
+    mapped = 1;
+  } else if((p = bareprocs) != 0){
+    bareprocs = p->pidnext;
   }
-  return 0;
-
-found:
-  p->pid = allocpid();
-  p->state = USED;
+  release(&pid_lock);
+  if(p == 0 && (p = procgrow()) == 0)
+    return 0;
 
-  // Allocate a trapframe page.
-  if((p->trapframe = (struct trapframe *)kalloc()) == 0){
-    freeproc(p);
+  // freeproc() may not have let go of it yet.
+  acquire(&p->lock);
+  if(p->state != UNUSED)
+    panic("allocproc");
+
+  if(!mapped && kvmmapstack(p->kstack) < 0){
+    acquire(&pid_lock);
+    p->pidnext = bareprocs;
+    bareprocs = p;
+    release(&pid_lock);
     release(&p->lock);
     return 0;
   }
-
-  // An empty user page table.
-  p->pagetable = proc_pagetable(p);
-  if(p->pagetable == 0){
+  allocpid(p);
+  p->state = USED;
+  p->cpu = -1;
+  p->nice = 0;
+  p->prio = 0;
+  p->slice = 0;
+  p->dl_runtime = 0;
+  p->dl_misses = 0;
+  p->tfslot = 0;
+
+  // Allocate a trapframe page. The caller gives p an
+  // address space (mmalloc() or mmshare()) to map it in.
+  if((p->trapframe = (struct trapframe *)kalloc()) == 0){
     freeproc(p);
     release(&p->lock);
     return 0;
@@ -155,20 +274,113 @@ found:
 static void
 freeproc(struct proc *p)
 {
+  if(p->mm)
+    mmput(p->mm, p->tfslot);
+  p->mm = 0;
+  if(p->fdt)
+    fdtput(p->fdt);
+  p->fdt = 0;
   if(p->trapframe)
     kfree((void*)p->trapframe);
   p->trapframe = 0;
-  if(p->pagetable)
-    proc_freepagetable(p->pagetable, p->sz);
-  p->pagetable = 0;
-  p->sz = 0;
-  p->pid = 0;
   p->parent = 0;
+  p->thread = 0;
+  p->sibnext = p->sibprev = 0;
   p->name[0] = 0;
   p->chan = 0;
   p->killed = 0;
   p->xstate = 0;
   p->state = UNUSED;
+
+  // out of the hash table, and onto the free list.
+  acquire(&pid_lock);
+  if(p->pid){
+    struct proc **pp;
+    for(pp = &pidhash[p->pid % NPIDHASH]; *pp != p; pp = &(*pp)->pidnext)
+      ;
+    *pp = p->pidnext;
+    nused--;
+  }
+  p->pid = 0;
+  p->pidnext = freeprocs;
+  freeprocs = p;
+  nfree++;
+  release(&pid_lock);
+}
+
+// Unmap the kernel stacks of all but the NFREESTACK most
+// recently freed procs on freeprocs, if there are more
+// than twice that many, and move those procs to bareprocs.
+// Called by wait() and join() with no locks held, so that
+// the TLB flush doesn't keep other CPUs waiting on them.
+static void
+proctrim(void)
+{
+  struct proc *list, *p, **pp;
+  uint64 pa, pages;
+  int i;
+
+  acquire(&pid_lock);
+  if(nfree <= 2*NFREESTACK){
+    release(&pid_lock);
+    return;
+  }
+  pp = &freeprocs;
+  for(i = 0; i < NFREESTACK; i++)
+    pp = &(*pp)->pidnext;
+  list = *pp;
+  *pp = 0;
+  nfree = NFREESTACK;
+  release(&pid_lock);
+
+  // none of these stacks is in use: each proc's last
+  // swtch() away from it was before freeproc(). chain
+  // the pages through their first words until the flush.
+  pages = 0;
+  for(p = list; p; p = p->pidnext){
+    pa = kvmunmapstack(p->kstack);
+    *(uint64*)pa = pages;
+    pages = pa;
+  }
+  tlbshootdown(0);
+  while((pa = pages) != 0){
+    pages = *(uint64*)pa;
+    kfree((void*)pa);
+  }
+
+  acquire(&pid_lock);
+  for(pp = &list; *pp; pp = &(*pp)->pidnext)
+    ;
+  *pp = bareprocs;
+  bareprocs = list;
+  release(&pid_lock);
+}
+
+// Make c a child of parent. Caller must hold wait_lock.
+static void
+childadd(struct proc *parent, struct proc *c)
+{
+  c->parent = parent;
+  c->sibprev = 0;
+  c->sibnext = parent->children;
+  if(c->sibnext)
+    c->sibnext->sibprev = c;
+  parent->children = c;
+}
+
+// Take c off its parent's list of children.
+// Caller must hold wait_lock.
+static void
+childdel(struct proc *c)
+{
+  if(c->sibprev)
+    c->sibprev->sibnext = c->sibnext;
+  else
+    c->parent->children = c->sibnext;
+  if(c->sibnext)
+    c->sibnext->sibprev = c->sibprev;
+  c->parent = 0;
+  c->sibnext = c->sibprev = 0;
 }
 
 // Create a user page table for a given process, with no user memory,
@@ -194,7 +406,7 @@ proc_pagetable(struct proc *p)
   }
 
   // map the trapframe page just below the trampoline page, for
-  // trampoline.S.
+  // trampoline.S. this is THREADFRAME(0); see thread.c.
   if(mappages(pagetable, TRAPFRAME, PGSIZE,
               (uint64)(p->trapframe), PTE_R | PTE_W) < 0){
     uvmunmap(pagetable, TRAMPOLINE, 1, 0);
@@ -205,16 +417,6 @@ proc_pagetable(struct proc *p)
   return pagetable;
 }
 
-// Free a process's page table, and free the
-// physical memory it refers to.
-void
-proc_freepagetable(pagetable_t pagetable, uint64 sz)
-{
-  uvmunmap(pagetable, TRAMPOLINE, 1, 0);
-  uvmunmap(pagetable, TRAPFRAME, 1, 0);
-  uvmfree(pagetable, sz);
-}
-
 // a user program that calls exec("/init")
 // assembled from ../user/initcode.S
 // od -t xC ../user/initcode
@@ -236,11 +438,13 @@ userinit(void)
 
   p = allocproc();
   initproc = p;
+  if((p->mm = mmalloc(p)) == 0 || (p->fdt = fdtalloc()) == 0)
+    panic("userinit");
   
   // allocate one user page and copy initcode's instructions
   // and data into it.
-  uvmfirst(p->pagetable, initcode, sizeof(initcode));
-  p->sz = PGSIZE;
+  uvmfirst(p->mm->pagetable, initcode, sizeof(initcode));
+  p->mm->sz = PGSIZE;
 
   // prepare for the very first "return" from kernel to user.
   p->trapframe->epc = 0;      // user program counter
@@ -249,29 +453,40 @@ userinit(void)
   safestrcpy(p->name, "initcode", sizeof(p->name));
   p->cwd = namei("/");
 
-  p->state = RUNNABLE;
+  setrunnable(p);
 
   release(&p->lock);
 }
 
 // Grow or shrink user memory by n bytes.
+// Growing only reserves the address space; vmfault()
+// allocates each page when it is first touched.
+// Sets *oldsz to the size before, which another thread
+// may change at any time.
 // Return 0 on success, -1 on failure.
 int
-growproc(int n)
+growproc(int n, uint64 *oldsz)
 {
   uint64 sz;
   struct proc *p = myproc();
+  struct mm *mm = p->mm;
+  int r = 0;
 
-  sz = p->sz;
+  acquire(&mm->lock);
+  sz = *oldsz = mm->sz;
   if(n > 0){
-    if((sz = uvmalloc(p->pagetable, sz, sz + n, PTE_W)) == 0) {
-      return -1;
-    }
+    if(sz + n > USERTOP || vmaoverlap(p, sz, PGROUNDUP(sz + n)))
+      r = -1;
+    else
+      sz += n;
   } else if(n < 0){
-    sz = uvmdealloc(p->pagetable, sz, sz + n);
+    // other threads may have the freed pages in their TLBs.
+    if((sz = uvmdealloc(mm->pagetable, sz, sz + n, mm->users > 1 ? 2 : 1)) != mm->sz + n)
+      r = -1;
   }
-  p->sz = sz;
-  return 0;
+  mm->sz = sz;
+  release(&mm->lock);
+  return r;
 }
 
 // Create a new process, copying the parent.
@@ -288,13 +503,27 @@ fork(void)
     return -1;
   }
 
-  // Copy user memory from parent to child.
-  if(uvmcopy(p->pagetable, np->pagetable, p->sz) < 0){
+  if((np->mm = mmalloc(np)) == 0 || (np->fdt = fdtalloc()) == 0){
     freeproc(np);
     release(&np->lock);
     return -1;
   }
-  np->sz = p->sz;
+
+  // Copy user memory from parent to child. Making the
+  // parent's writable pages copy-on-write takes PTE_W away,
+  // which other threads' TLBs may not have seen; flush them
+  // before mm->lock lets a thread fault on those pages, or
+  // its stores would reach pages the child now shares.
+  acquire(&p->mm->lock);
+  if(uvmcopy(p->mm->pagetable, np->mm->pagetable, p->mm->sz) < 0)
+    goto bad;
+  np->mm->sz = p->mm->sz;
+  if(vmacopy(p->mm->pagetable, np->mm->pagetable, p->mm->vmas) < 0)
+    goto bad;
+  vmadup(np->mm->vmas, p->mm->vmas);
+  if(p->mm->users > 1)
+    tlbshootdown(p->mm->pagetable);
+  release(&p->mm->lock);
 
   // copy saved user registers.
   *(np->trapframe) = *(p->trapframe);
@@ -303,23 +532,86 @@ fork(void)
   np->trapframe->a0 = 0;
 
   // increment reference counts on open file descriptors.
+  acquire(&p->fdt->lock);
   for(i = 0; i < NOFILE; i++)
-    if(p->ofile[i])
-      np->ofile[i] = filedup(p->ofile[i]);
+    if(p->fdt->ofile[i])
+      np->fdt->ofile[i] = filedup(p->fdt->ofile[i]);
+  release(&p->fdt->lock);
   np->cwd = idup(p->cwd);
 
   safestrcpy(np->name, p->name, sizeof(p->name));
 
+  np->nice = p->nice;
+
   pid = np->pid;
 
   release(&np->lock);
 
   acquire(&wait_lock);
-  np->parent = p;
+  childadd(p, np);
   release(&wait_lock);
 
   acquire(&np->lock);
-  np->state = RUNNABLE;
+  setrunnable(np);
+  release(&np->lock);
+
+  return pid;
+
+ bad:
+  release(&p->mm->lock);
+  freeproc(np);
+  release(&np->lock);
+  return -1;
+}
+
+// Create a thread that shares the caller's memory and open
+// files, and starts at fn(arg) on the given user stack.
+// The thread is reaped by join(), not wait().
+// Returns the new thread's pid, or -1.
+int
+clone(uint64 fn, uint64 arg, uint64 stack)
+{
+  int pid, k;
+  struct proc *np;
+  struct proc *p = myproc();
+
+  if(stack % 16 != 0)
+    return -1;
+
+  if((np = allocproc()) == 0){
+    return -1;
+  }
+  if(mmshare(np, p->mm) < 0){
+    freeproc(np);
+    release(&np->lock);
+    return -1;
+  }
+  np->fdt = fdtdup(p->fdt);
+
+  *(np->trapframe) = *(p->trapframe);
+  np->trapframe->epc = fn;
+  np->trapframe->a0 = arg;
+  np->trapframe->sp = stack;
+  np->trapframe->ra = 0;
+
+  np->cwd = idup(p->cwd);
+  safestrcpy(np->name, p->name, sizeof(p->name));
+  np->nice = p->nice;
+  pid = np->pid;
+  release(&np->lock);
+
+  acquire(&wait_lock);
+  childadd(p, np);
+  np->thread = 1;
+  // kill() of the other threads is done under wait_lock,
+  // so either it sees np, or np inherits it here.
+  k = killed(p);
+  release(&wait_lock);
+
+  acquire(&np->lock);
+  if(k)
+    np->killed = 1;
+  setrunnable(np);
   release(&np->lock);
 
   return pid;
@@ -332,35 +624,73 @@ reparent(struct proc *p)
 {
   struct proc *pp;
 
-  for(pp = proc; pp < &proc[NPROC]; pp++){
-    if(pp->parent == p){
-      pp->parent = initproc;
-      wakeup(initproc);
+  if(p->children == 0)
+    return;
+  while((pp = p->children) != 0){
+    childdel(pp);
+    childadd(initproc, pp);
+  }
+  wakeup(initproc);
+}
+
+// Mark every live proc that uses mm as killed, except p.
+// Caller must hold wait_lock, which keeps mm from being
+// freed and keeps clone() from missing the kill.
+static void
+killmm(struct mm *mm, struct proc *p)
+{
+  struct proc *pp;
+  int i;
+
+  for(i = 0; (pp = procat(i)) != 0; i++){
+    if(pp == p)
+      continue;
+    acquire(&pp->lock);
+    if(pp->mm == mm && pp->state != UNUSED && pp->state != ZOMBIE){
+      pp->killed = 1;
+      if(pp->state == SLEEPING)
+        setrunnable(pp);
     }
+    release(&pp->lock);
   }
 }
 
-// Exit the current process.  Does not return.
-// An exited process remains in the zombie state
-// until its parent calls wait().
-void
-exit(int status)
+// Exit the current thread.  Does not return.
+// A thread made by clone() remains in the zombie state until
+// another thread calls join(); the first thread of a process
+// until its parent calls wait(), which it lets happen only
+// once the other threads are gone.
+static void
+exitthread(int status)
 {
   struct proc *p = myproc();
+  struct mm *mm = p->mm;
+  int last;
 
   if(p == initproc)
     panic("init exiting");
 
-  // Close all open files.
-  for(int fd = 0; fd < NOFILE; fd++){
-    if(p->ofile[fd]){
-      struct file *f = p->ofile[fd];
-      fileclose(f);
-      p->ofile[fd] = 0;
-    }
+  if(!p->thread){
+    // wait for the other threads, exit()ed or killed.
+    acquire(&wait_lock);
+    while(mm->users > 1)
+      sleep(mm, &wait_lock);
+    if(mm->exiting)
+      status = mm->xstate;
+    release(&wait_lock);
   }
 
+  // Close all open files, if no other thread has them.
+  fdtput(p->fdt);
+  p->fdt = 0;
+
+  if((last = mmexit(p)) != 0)
+    munmapall(p);
+  edfexit(p);
+
   begin_op();
+  if(last)
+    vmaclear(p->mm->vmas);
   iput(p->cwd);
   end_op();
   p->cwd = 0;
@@ -370,8 +700,11 @@ exit(int status)
   // Give any children to init.
   reparent(p);
 
-  // Parent might be sleeping in wait().
+  // Parent might be sleeping in wait(), another thread
+  // in join(), or the first thread in exitthread().
   wakeup(p->parent);
+  if(p->thread)
+    wakeup(p->mm);
   
   acquire(&p->lock);
 
@@ -385,7 +718,38 @@ exit(int status)
   panic("zombie exit");
 }
 
+// Exit the current process: kill its other threads, and
+// report status to the parent once they have all exited.
+// Does not return.
+void
+exit(int status)
+{
+  struct proc *p = myproc();
+  struct mm *mm = p->mm;
+
+  acquire(&wait_lock);
+  if(!mm->exiting){
+    mm->exiting = 1;
+    mm->xstate = status;
+  }
+  if(mm->ref > 1)
+    killmm(mm, p);
+  release(&wait_lock);
+  exitthread(status);
+}
+
+// Exit just the current thread, if clone() made it;
+// otherwise the whole process, as exit() does.
+void
+texit(int status)
+{
+  if(myproc()->thread)
+    exitthread(status);
+  exit(status);
+}
+
 // Wait for a child process to exit and return its pid.
+// Threads sharing the caller's memory are left to join().
 // Return -1 if this process has no children.
 int
 wait(uint64 addr)
@@ -394,13 +758,18 @@ wait(uint64 addr)
   int havekids, pid;
   struct proc *p = myproc();
 
+  // the copyout_locked() of the exit status happens under locks,
+  // where it can't fault pages in from a file.
+  if(addr != 0)
+    uvmprefault(p->mm->pagetable, addr, sizeof(int), 1);
+
   acquire(&wait_lock);
 
   for(;;){
-    // Scan through table looking for exited children.
+    // Scan through p's children looking for exited ones.
     havekids = 0;
-    for(pp = proc; pp < &proc[NPROC]; pp++){
-      if(pp->parent == p){
+    for(pp = p->children; pp; pp = pp->sibnext){
+      if(!(pp->thread && pp->mm == p->mm)){
         // make sure the child isn't still in exit() or swtch().
         acquire(&pp->lock);
 
@@ -408,15 +777,17 @@ wait(uint64 addr)
         if(pp->state == ZOMBIE){
           // Found one.
           pid = pp->pid;
-          if(addr != 0 && copyout(p->pagetable, addr, (char *)&pp->xstate,
-                                  sizeof(pp->xstate)) < 0) {
+          if(addr != 0 && copyout_locked(p->mm->pagetable, addr, (char *)&pp->xstate,
+                                         sizeof(pp->xstate)) < 0) {
             release(&pp->lock);
             release(&wait_lock);
             return -1;
           }
+          childdel(pp);
           freeproc(pp);
           release(&pp->lock);
           release(&wait_lock);
+          proctrim();
           return pid;
         }
         release(&pp->lock);
@@ -434,10 +805,59 @@ wait(uint64 addr)
   }
 }
 
+// Wait for thread tid, which shares the caller's memory, to
+// exit, and copy its exit status to addr if non-zero. Any
+// of the other threads may join it, not just its creator.
+// Returns tid, or -1 if there is no such thread.
+int
+join(int tid, uint64 addr)
+{
+  struct proc *pp;
+  struct proc *p = myproc();
+
+  if(addr != 0)
+    uvmprefault(p->mm->pagetable, addr, sizeof(int), 1);
+
+  acquire(&wait_lock);
+
+  for(;;){
+    if((pp = pidlookup(tid)) == 0)
+      break;
+    if(pp == p || !pp->thread || pp->mm != p->mm){
+      release(&pp->lock);
+      break;
+    }
+    if(pp->state == ZOMBIE){
+      if(addr != 0 && copyout_locked(p->mm->pagetable, addr, (char *)&pp->xstate,
+                                     sizeof(pp->xstate)) < 0) {
+        release(&pp->lock);
+        release(&wait_lock);
+        return -1;
+      }
+      childdel(pp);
+      freeproc(pp);
+      release(&pp->lock);
+      release(&wait_lock);
+      proctrim();
+      return tid;
+    }
+    release(&pp->lock);
+
+    if(killed(p))
+      break;
+
+    // Wait for a thread of p->mm to exit.
+    sleep(p->mm, &wait_lock);
+  }
+  release(&wait_lock);
+  return -1;
+}
+
 // Per-CPU process scheduler.
 // Each CPU calls scheduler() after setting itself up.
 // Scheduler never returns.  It loops, doing:
-//  - choose a process to run.
+//  - take a process off this CPU's run queue, or,
+//    if it is empty, off another CPU's.
 //  - swtch to start running that process.
 //  - eventually that process transfers control
 //    via swtch back to the scheduler.
@@ -446,28 +866,35 @@ scheduler(void)
 {
   struct proc *p;
   struct cpu *c = mycpu();
-  
+
   c->proc = 0;
   for(;;){
     // Avoid deadlock by ensuring that devices can interrupt.
     intr_on();
 
-    for(p = proc; p < &proc[NPROC]; p++) {
-      acquire(&p->lock);
-      if(p->state == RUNNABLE) {
-        // Switch to chosen process.  It is the process's job
-        // to release its lock and then reacquire it
-        // before jumping back to us.
-        p->state = RUNNING;
-        c->proc = p;
-        swtch(&c->context, &p->context);
-
-        // Process is done running for now.
-        // It should have changed its p->state before coming back.
-        c->proc = 0;
-      }
-      release(&p->lock);
+    if((p = runqpop(c)) == 0 && (p = runqsteal(c)) == 0){
+      // nothing to run; get pages ready for kalloc_zeroed(),
+      // then wait for an interrupt.
+      kzerofill();
+      cpuidle(c);
+      continue;
     }
+
+    acquire(&p->lock);
+    if(p->state == RUNNABLE) {
+      // Switch to chosen process.  It is the process's job
+      // to release its lock and then reacquire it
+      // before jumping back to us.
+      p->state = RUNNING;
+      p->cpu = c - cpus;
+      c->proc = p;
+      swtch(&c->context, &p->context);
+
+      // Process is done running for now.
+      // It should have changed its p->state before coming back.
+      c->proc = 0;
+    }
+    release(&p->lock);
   }
 }
 
@@ -504,7 +931,7 @@ yield(void)
 {
   struct proc *p = myproc();
   acquire(&p->lock);
-  p->state = RUNNABLE;
+  setrunnable(p);
   sched();
   release(&p->lock);
 }
@@ -530,77 +957,198 @@ forkret(void)
   usertrapret();
 }
 
-// Atomically release lock and sleep on chan.
-// Reacquires lock when awakened.
-void
-sleep(void *chan, struct spinlock *lk)
+static struct waitq*
+waitq(void *chan)
+{
+  uint64 h = (uint64)chan;
+
+  h ^= h >> 12;
+  h *= 0x9E3779B97F4A7C15UL;
+  return &waitqs[(h >> 32) % NWAITQ];
+}
+
+// Take p off its wait queue q. Caller must hold q->lock.
+static void
+waitqunlink(struct waitq *q, struct proc *p)
+{
+  if(p->wqprev)
+    p->wqprev->wqnext = p->wqnext;
+  else
+    q->head = p->wqnext;
+  if(p->wqnext)
+    p->wqnext->wqprev = p->wqprev;
+  else
+    q->tail = p->wqprev;
+  p->wq = 0;
+  p->wqnext = p->wqprev = 0;
+}
+
+static void
+sleepq(void *chan, struct spinlock *lk, int excl)
 {
   struct proc *p = myproc();
+  struct waitq *q = waitq(chan);
   
   // Must acquire p->lock in order to
   // change p->state and then call sched.
-  // Once we hold p->lock, we can be
+  // Once we hold the queue's lock, we can be
   // guaranteed that we won't miss any wakeup
-  // (wakeup locks p->lock),
+  // (wakeup locks it),
   // so it's okay to release lk.
 
+  acquire(&q->lock);
   acquire(&p->lock);  //DOC: sleeplock1
   release(lk);
 
-  // Go to sleep.
+  // Go to sleep: the exclusive at the tail, the rest
+  // at the head.
+  p->wq = q;
+  p->wqexcl = excl;
+  if(excl){
+    p->wqnext = 0;
+    p->wqprev = q->tail;
+    if(q->tail)
+      q->tail->wqnext = p;
+    else
+      q->head = p;
+    q->tail = p;
+  } else {
+    p->wqprev = 0;
+    p->wqnext = q->head;
+    if(q->head)
+      q->head->wqprev = p;
+    else
+      q->tail = p;
+    q->head = p;
+  }
   p->chan = chan;
   p->state = SLEEPING;
+  release(&q->lock);
 
   sched();
 
   // Tidy up.
   p->chan = 0;
+  release(&p->lock);
+
+  // still on the queue if something other than
+  // wakeup() woke us.
+  if(p->wq){
+    acquire(&q->lock);
+    if(p->wq)
+      waitqunlink(q, p);
+    release(&q->lock);
+  }
 
   // Reacquire original lock.
-  release(&p->lock);
   acquire(lk);
 }
 
-// Wake up all processes sleeping on chan.
-// Must be called without any p->lock.
+// Atomically release lock and sleep on chan.
+// Reacquires lock when awakened.
 void
-wakeup(void *chan)
+sleep(void *chan, struct spinlock *lk)
 {
-  struct proc *p;
+  sleepq(chan, lk, 0);
+}
 
-  for(p = proc; p < &proc[NPROC]; p++) {
-    if(p != myproc()){
-      acquire(&p->lock);
-      if(p->state == SLEEPING && p->chan == chan) {
-        p->state = RUNNABLE;
-      }
-      release(&p->lock);
+// As sleep(), but wakeupn() wakes exclusive sleepers only
+// n at a time, oldest first. A process woken this way that
+// doesn't use what it was woken for should pass the wakeup on.
+void
+sleep_excl(void *chan, struct spinlock *lk)
+{
+  sleepq(chan, lk, 1);
+}
+
+// Wake up all non-exclusive processes sleeping on chan,
+// and up to n exclusive ones, or all if n < 0.
+// Must be called without any p->lock.
+void
+wakeupn(void *chan, int n)
+{
+  struct waitq *q = waitq(chan);
+  struct proc *p, *next;
+
+  acquire(&q->lock);
+  for(p = q->head; p; p = next){
+    next = p->wqnext;
+    if(p->wqexcl && n == 0)
+      break;
+    acquire(&p->lock);
+    if(p->state == SLEEPING && p->chan == chan){
+      waitqunlink(q, p);
+      if(p->wqexcl)
+        n--;
+      setrunnable(p);
     }
+    release(&p->lock);
   }
+  release(&q->lock);
+}
+
+// Wake up all processes sleeping on chan.
+// Must be called without any p->lock.
+void
+wakeup(void *chan)
+{
+  wakeupn(chan, -1);
 }
 
-// Kill the process with the given pid.
-// The victim won't exit until it tries to return
+// Kill the process with the given pid, and the threads
+// that share its memory.
+// The victims won't exit until they try to return
 // to user space (see usertrap() in trap.c).
 int
 kill(int pid)
 {
   struct proc *p;
+  struct mm *mm;
+  int threaded;
 
-  for(p = proc; p < &proc[NPROC]; p++){
-    acquire(&p->lock);
-    if(p->pid == pid){
-      p->killed = 1;
-      if(p->state == SLEEPING){
-        // Wake process from sleep().
-        p->state = RUNNABLE;
-      }
-      release(&p->lock);
-      return 0;
-    }
-    release(&p->lock);
+  // wait_lock keeps mm from being freed and reused, since
+  // wait() and join() hold it while freeing procs.
+  acquire(&wait_lock);
+  if((p = pidlookup(pid)) == 0){
+    release(&wait_lock);
+    return -1;
   }
-  return -1;
+  mm = p->mm;
+  threaded = mm && mm->ref > 1;
+  p->killed = 1;
+  if(p->state == SLEEPING){
+    // Wake process from sleep().
+    setrunnable(p);
+  }
+  release(&p->lock);
+
+  // only a process with threads needs the whole table
+  // searched; clone() sees to threads made meanwhile.
+  if(threaded)
+    killmm(mm, 0);
+  release(&wait_lock);
+  return 0;
+}
+
+// Set the nice value of the process with the given pid,
+// or of the caller if pid is 0. The scheduler picks it
+// up the next time the process runs or is queued.
+// Returns 0, or -1 if there is no such process or nice
+// is out of range.
+int
+setpriority(int pid, int nice)
+{
+  struct proc *p;
+
+  if(nice < NICE_MIN || nice > NICE_MAX)
+    return -1;
+  if(pid == 0)
+    pid = myproc()->pid;
+  if((p = pidlookup(pid)) == 0)
+    return -1;
+  p->nice = nice;
+  release(&p->lock);
+  return 0;
 }
 
 void
@@ -623,14 +1171,16 @@ killed(struct proc *p)
 }
 
 // Copy to either a user address, or kernel address,
-// depending on usr_dst.
+// depending on usr_dst. Callers hold locks (readi() the
+// inode's, consoleread() cons.lock), so a user page of an
+// mmap()ed file must have been faulted in already.
 // Returns 0 on success, -1 on error.
 int
 either_copyout(int user_dst, uint64 dst, void *src, uint64 len)
 {
   struct proc *p = myproc();
   if(user_dst){
-    return copyout(p->pagetable, dst, src, len);
+    return copyout_locked(p->mm->pagetable, dst, src, len);
   } else {
     memmove((char *)dst, src, len);
     return 0;
@@ -638,14 +1188,14 @@ either_copyout(int user_dst, uint64 dst, void *src, uint64 len)
 }
 
 // Copy from either a user address, or kernel address,
-// depending on usr_src.
+// depending on usr_src; as for either_copyout().
 // Returns 0 on success, -1 on error.
 int
 either_copyin(void *dst, int user_src, uint64 src, uint64 len)
 {
   struct proc *p = myproc();
   if(user_src){
-    return copyin(p->pagetable, dst, src, len);
+    return copyin_locked(p->mm->pagetable, dst, src, len);
   } else {
     memmove(dst, (char*)src, len);
     return 0;
@@ -670,7 +1220,7 @@ procdump(void)
   char *state;
 
   printf("\n");
-  for(p = proc; p < &proc[NPROC]; p++){
+  for(int i = 0; (p = procat(i)) != 0; i++){
     if(p->state == UNUSED)
       continue;
     if(p->state >= 0 && p->state < NELEM(states) && states[p->state])
@@ -681,3 +1231,19 @@ procdump(void)
     printf("\n");
   }
 }
+
+// Report how many processes there are, the most there have
+// been, and how many struct procs have been allocated.
+int
+procstats(char *buf, int sz)
+{
+  int used, top, free;
+
+  acquire(&pid_lock);
+  used = nused;
+  top = peak;
+  free = nfree;
+  release(&pid_lock);
+  return snprintf(buf, sz, "proc: %d in use, peak %d, %d allocated, %d free with stacks, limit %d\n",
+                  used, top, __atomic_load_n(&nprocs, __ATOMIC_ACQUIRE), free, NPROC);
+}
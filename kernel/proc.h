@@ -18,15 +18,45 @@ struct context {
   uint64 s11;
 };
 
+// A CPU's queue of RUNNABLE processes; see sched.c.
+#ifdef SCHED_MLFQ
+#define NPRIO 4                // MLFQ priority levels
+#else
+#define NPRIO 1
+#endif
+
+struct runq {
+  struct spinlock lock;
+#ifdef SCHED_CFS
+  struct proc *heap[NPROC];   // min-heap on p->vruntime
+  uint64 minvruntime;         // never decreases
+#else
+  struct proc *head[NPRIO];   // a list per level, linked through p->rqnext
+  struct proc *tail[NPRIO];
+#endif
+  int len;
+  uint64 nenq;                // processes ever enqueued
+  uint64 ndeq;                // ... and dequeued
+  uint64 nsteal;              // taken from another CPU while idle
+  uint64 nmoved;              // pulled here by the periodic balancer
+  int ticks;                  // timer ticks, for the balancer
+  uint boost;                 // MLFQ priority boosts applied here
+};
+
 // Per-CPU state.
 struct cpu {
   struct proc *proc;          // The process running on this cpu, or null.
   struct context context;     // swtch() here to enter scheduler().
   int noff;                   // Depth of push_off() nesting.
   int intena;                 // Were interrupts enabled before push_off()?
+  struct runq rq;             // Processes waiting to run here.
+  volatile int idle;          // Waiting in wfi; IPI to wake.
+  uint64 idletime;            // CLINT_MTIME cycles spent idle.
+  uint64 nexttick;            // CLINT_MTIME value of the next tick.
 };
 
 extern struct cpu cpus[NCPU];
+extern int ncpu;               // CPUs that have started
 
 // per-process data for the trap handling code in trampoline.S.
 // sits in a page by itself just under the trampoline page in the
@@ -79,6 +109,51 @@ struct trapframe {
   /* 280 */ uint64 t6;
 };
 
+// A region of user memory whose pages are read in from an
+// inode when first touched; see vma.c.
+struct vma {
+  uint64 start;                // first virtual address, page-aligned
+  uint64 end;                  // one past the last virtual address
+  int perm;                    // PTE bits for the region's pages
+  struct inode *ip;            // backing inode; 0 if slot is unused
+  uint off;                    // offset in ip of the data at start
+  uint filesz;                 // bytes from ip; the rest reads as zero
+  int flags;                   // MAP_SHARED or MAP_PRIVATE if mmap()ed; 0 for exec
+};
+
+// A user address space, which the threads of a process
+// share; see thread.c.
+struct mm {
+  struct spinlock lock;        // protects the fields below and the PTEs
+  int ref;                     // procs using it, zombies included
+  int users;                   // threads that haven't exited
+  uint tfslots;                // THREADFRAME() slots in use, a bit each
+  int fills;                   // vmafill()s reading a page in
+  int exiting;                 // a thread called exit(); under wait_lock
+  int xstate;                  // its status, for the parent's wait()
+  pagetable_t pagetable;       // User page table
+  uint64 sz;                   // Size of process memory (bytes)
+  struct vma vmas[NVMA];       // Demand-paged memory regions
+};
+
+// Open files, which the threads of a process share.
+struct fdtable {
+  struct spinlock lock;        // protects ref and allocating fds
+  int ref;
+  struct file *ofile[NOFILE];  // Open files
+};
+
+// A one-shot timer; see timer.c.
+struct timer {
+  uint64 expires;              // CLINT_MTIME value
+  void (*fn)(struct timer*);   // called on expiry, with the wheel locked
+  void *arg;
+  int cpu;                     // wheel the timer is pending on, or -1
+  struct timer *next;          // in a wheel slot
+  struct timer *prev;
+  struct timer **head;         // the slot
+};
+
 enum procstate { UNUSED, USED, SLEEPING, RUNNABLE, RUNNING, ZOMBIE };
 
 // Per-process state
@@ -91,17 +166,55 @@ struct proc {
   int killed;                  // If non-zero, have been killed
   int xstate;                  // Exit status to be returned to parent's wait
   int pid;                     // Process ID
+  int cpu;                     // CPU whose run queue p goes on, or -1
+  int nice;                    // NICE_MIN (favoured) to NICE_MAX
+
+  // the run queue's lock must be held when using this:
+  struct proc *rqnext;         // Next on the run queue
+
+  // used only by p itself while running, or under the run
+  // queue's lock while p is on it:
+  int prio;                    // MLFQ level, 0 highest
+  int slice;                   // timer ticks used at this level
+  uint boost;                  // last MLFQ boost applied
+  uint64 vruntime;             // CFS run time, weighted by nice
+
+  // real-time parameters and state, in ticks; see edf.c.
+  // dl_runtime is 0 unless p is real-time.
+  int dl_runtime;              // budget per period
+  int dl_period;
+  int dl_deadline;             // relative to the start of a period
+  int dl_left;                 // budget left in this period
+  uint dl_abs;                 // this period's absolute deadline
+  uint dl_next;                // when the next period may start
+  uint64 dl_misses;            // deadlines missed
 
-  // wait_lock must be held when using this:
+  struct timer timer;          // for timersleep(); see timer.c
+
+  // the lock of the wait queue p is on must be held when
+  // using these; see sleep().
+  struct waitq *wq;            // wait queue p is on, or 0
+  struct proc *wqnext;
+  struct proc *wqprev;
+  int wqexcl;                  // woken one at a time; see sleep_excl()
+
+  // pid_lock must be held when using these:
+  struct proc *pidnext;        // in the pid hash chain, or the free list if UNUSED
+
+  // wait_lock must be held when using these:
   struct proc *parent;         // Parent process
+  int thread;                  // made by clone(); reaped by join(), not wait()
+  struct proc *children;       // first child
+  struct proc *sibnext;        // the parent's other children
+  struct proc *sibprev;
 
   // these are private to the process, so p->lock need not be held.
   uint64 kstack;               // Virtual address of kernel stack
-  uint64 sz;                   // Size of process memory (bytes)
-  pagetable_t pagetable;       // User page table
+  struct mm *mm;               // User memory, shared with p's threads
+  struct fdtable *fdt;         // Open files, shared with p's threads
   struct trapframe *trapframe; // data page for trampoline.S
+  int tfslot;                  // trapframe is at THREADFRAME(tfslot)
   struct context context;      // swtch() here to run process
-  struct file *ofile[NOFILE];  // Open files
   struct inode *cwd;           // Current directory
   char name[16];               // Process name (debugging)
 };
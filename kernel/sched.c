@@ -0,0 +1,559 @@
+//
+// Per-CPU run queues.
+//
+// Each CPU has a queue of RUNNABLE processes, so scheduler()
+// finds the next process to run in O(1) instead of scanning
+// the process table. setrunnable() puts a process on the queue of the
+// CPU it last ran on, or of the current CPU if it is new or
+// is giving up the CPU; scheduler() takes from its own queue.
+//
+// Work moves between CPUs two ways: a CPU whose queue is
+// empty steals a process from the longest queue, and every
+// BALANCE_TICKS timer ticks each CPU pulls processes from
+// the longest queue until the two are within one of each
+// other.
+//
+// Locking: p->lock before a run queue's lock. A process is on
+// a queue exactly when it is RUNNABLE. scheduler() takes a
+// process off its queue before acquiring p->lock, so it must
+// re-check that the process is still RUNNABLE. Code that
+// holds two run queue locks takes them in cpus[] order.
+//
+// The policy is chosen at build time (SCHEDPOLICY in the
+// Makefile). SCHED_RR, the default, runs processes in FIFO
+// order for one tick each. SCHED_MLFQ keeps NPRIO FIFOs per
+// queue and runs the highest non-empty level first. A process
+// that uses up its level's slice moves down a level; sleeping
+// doesn't reset the slice, so a process can't stay on top by
+// yielding just before it runs out. Every BOOST_TICKS ticks
+// all processes move back to the top, so none starves. A
+// positive nice value keeps a process below the top level,
+// the further the higher it is: 1-7 below level 0, 8-13
+// below level 1, and 14-19 at the bottom. There is nothing
+// above the top, so under MLFQ a negative nice value is the
+// same as 0; only SCHED_CFS tells them apart.
+//
+// Real-time processes don't use these queues; see edf.c.
+//
+// A CPU with nothing to run waits for an interrupt in
+// cpuidle(). When setrunnable() queues work that the target
+// CPU can't start at once, it sends an idle CPU a reschedule
+// IPI; a real-time process with no idle CPU to go to makes
+// a CPU running an ordinary process give it up.
+//
+// SCHED_CFS charges each tick to the running process's
+// vruntime, scaled down by a weight that grows as its nice
+// value falls, and always runs the process with the least
+// vruntime, kept in a min-heap per queue. Each queue's
+// minvruntime follows the least vruntime there. A process
+// that wakes up is placed no more than SLEEP_CREDIT behind
+// it, so sleeping doesn't bank CPU time, and one that moves
+// to another CPU keeps its distance from it.
+//
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "defs.h"
+
+#define BALANCE_TICKS 10  // timer ticks between balancing runs
+
+#ifdef SCHED_MLFQ
+#define BOOST_TICKS 100   // timer ticks between MLFQ priority boosts
+
+// timer ticks a process may use at each level before it
+// moves down.
+static int slice[NPRIO] = { 1, 2, 4, 8 };
+
+static uint boost;        // ticks / BOOST_TICKS at the last boost
+
+// The highest level p may run at: 0 for nice 0 or less,
+// with 1..NICE_MAX spread over levels 1..NPRIO-1. Reads
+// p->nice without p->lock; a stale value only misplaces p
+// until it next runs.
+static int
+baseprio(struct proc *p)
+{
+  if(p->nice <= 0)
+    return 0;
+  return 1 + (p->nice - 1) * (NPRIO - 1) / NICE_MAX;
+}
+
+// Apply any boost p missed and any change to its nice value.
+static void
+mlfqrefresh(struct proc *p)
+{
+  if(p->boost != boost){
+    p->boost = boost;
+    p->prio = 0;
+    p->slice = 0;
+  }
+  if(p->prio < baseprio(p)){
+    p->prio = baseprio(p);
+    p->slice = 0;
+  }
+}
+#endif
+
+#ifdef SCHED_CFS
+#define NICE0_WEIGHT 1024
+#define SLEEP_CREDIT (3 * NICE0_WEIGHT)  // three ticks at nice 0
+
+// weight of each nice value from NICE_MIN up. each step
+// is about 1.25x, i.e. about 10% more or less CPU.
+static int weights[NICE_MAX - NICE_MIN + 1] = {
+  /* -20 */ 88761, 71755, 56483, 46273, 36291,
+  /* -15 */ 29154, 23254, 18705, 14949, 11916,
+  /* -10 */  9548,  7620,  6100,  4904,  3906,
+  /*  -5 */  3121,  2501,  1991,  1586,  1277,
+  /*   0 */  1024,   820,   655,   526,   423,
+  /*   5 */   335,   272,   215,   172,   137,
+  /*  10 */   110,    87,    70,    56,    45,
+  /*  15 */    36,    29,    23,    18,    15,
+};
+#endif
+
+void
+runqinit(void)
+{
+  for(int i = 0; i < NCPU; i++)
+    initlock(&cpus[i].rq.lock, "runq");
+}
+
+#ifdef SCHED_CFS
+// Advance rq->minvruntime to the least of vr, the vruntime
+// of the process running, and those on rq.
+// Caller must hold rq->lock.
+static void
+rqsetmin(struct runq *rq, uint64 vr)
+{
+  if(rq->len > 0 && rq->heap[0]->vruntime < vr)
+    vr = rq->heap[0]->vruntime;
+  if(vr > rq->minvruntime)
+    rq->minvruntime = vr;
+}
+
+// Add p to rq's heap. Caller must hold rq->lock.
+static void
+rqenqueue(struct runq *rq, struct proc *p)
+{
+  int i, up;
+
+  for(i = rq->len++; i > 0; i = up){
+    up = (i - 1) / 2;
+    if(rq->heap[up]->vruntime <= p->vruntime)
+      break;
+    rq->heap[i] = rq->heap[up];
+  }
+  rq->heap[i] = p;
+  rq->nenq++;
+}
+
+// Remove and return the process on rq with the least
+// vruntime, or 0. Caller must hold rq->lock.
+static struct proc*
+rqdequeue(struct runq *rq)
+{
+  struct proc *p, *last;
+  int i, down;
+
+  if(rq->len == 0)
+    return 0;
+  p = rq->heap[0];
+  last = rq->heap[--rq->len];
+  for(i = 0; (down = 2*i + 1) < rq->len; i = down){
+    if(down + 1 < rq->len && rq->heap[down+1]->vruntime < rq->heap[down]->vruntime)
+      down++;
+    if(last->vruntime <= rq->heap[down]->vruntime)
+      break;
+    rq->heap[i] = rq->heap[down];
+  }
+  rq->heap[i] = last;
+  rq->ndeq++;
+  rqsetmin(rq, p->vruntime);
+  return p;
+}
+#else
+// Append p to rq at its level. Caller must hold rq->lock.
+static void
+rqenqueue(struct runq *rq, struct proc *p)
+{
+  int i = p->prio;
+
+  p->rqnext = 0;
+  if(rq->tail[i])
+    rq->tail[i]->rqnext = p;
+  else
+    rq->head[i] = p;
+  rq->tail[i] = p;
+  rq->len++;
+  rq->nenq++;
+}
+
+// Remove and return the first process of the highest
+// non-empty level of rq, or 0. Caller must hold rq->lock.
+static struct proc*
+rqdequeue(struct runq *rq)
+{
+  struct proc *p;
+  int i;
+
+  for(i = 0; i < NPRIO; i++){
+    if((p = rq->head[i]) != 0)
+      break;
+  }
+  if(i == NPRIO)
+    return 0;
+  rq->head[i] = p->rqnext;
+  if(rq->head[i] == 0)
+    rq->tail[i] = 0;
+  p->rqnext = 0;
+  rq->len--;
+  rq->ndeq++;
+  return p;
+}
+#endif
+
+// p is moving from queue from to queue to.
+static void
+rqmigrate(struct proc *p, struct runq *from, struct runq *to)
+{
+#ifdef SCHED_CFS
+  uint64 v = p->vruntime + to->minvruntime;
+
+  p->vruntime = v > from->minvruntime ? v - from->minvruntime : 0;
+#endif
+}
+
+// Work was just queued for target, or for any CPU if target
+// is 0. Wake target if it is idle; otherwise, if the work has
+// to wait, wake some idle CPU to steal it. Returns 0 if there
+// was no CPU to wake.
+static int
+wakeidle(struct cpu *target, int waiting)
+{
+  struct cpu *c;
+
+  if(target && target->idle){
+    ipi_resched(target - cpus);
+    return 1;
+  }
+  if(target && !waiting)
+    return 1;
+  for(c = cpus; c < &cpus[ncpu]; c++){
+    if(c->idle){
+      ipi_resched(c - cpus);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// A real-time process was just queued and no CPU is idle:
+// preempt one running an ordinary process, if any. An
+// unlocked look; at worst the process waits for a tick.
+static void
+preemptnormal(void)
+{
+  struct cpu *c;
+  struct proc *p;
+
+  for(c = cpus; c < &cpus[ncpu]; c++){
+    p = c->proc;
+    if(p && p->dl_runtime == 0){
+      ipi_resched(c - cpus);
+      return;
+    }
+  }
+}
+
+// Make p RUNNABLE and put it on a run queue.
+// Caller must hold p->lock.
+void
+setrunnable(struct proc *p)
+{
+  struct runq *rq;
+  struct cpu *c;
+  int fresh = p->cpu < 0;
+
+  if(!holding(&p->lock))
+    panic("setrunnable");
+
+  // a process giving up this CPU, or a new one, stays here;
+  // a woken one goes back to the CPU whose cache it warmed.
+  push_off();
+  if(p->state == RUNNING || fresh)
+    p->cpu = cpuid();
+  pop_off();
+
+  if(p->dl_runtime){
+    p->state = RUNNABLE;
+    edfenqueue(p);
+    if(!wakeidle(0, 1))
+      preemptnormal();
+    return;
+  }
+#ifdef SCHED_MLFQ
+  mlfqrefresh(p);
+#endif
+  rq = &cpus[p->cpu].rq;
+  acquire(&rq->lock);
+#ifdef SCHED_CFS
+  if(fresh)
+    p->vruntime = rq->minvruntime;
+  else if(p->state == SLEEPING && p->vruntime + SLEEP_CREDIT < rq->minvruntime)
+    p->vruntime = rq->minvruntime - SLEEP_CREDIT;
+#endif
+  p->state = RUNNABLE;
+  rqenqueue(rq, p);
+  release(&rq->lock);
+
+  // p has to wait if its CPU is running something else, or
+  // has something else queued.
+  c = &cpus[p->cpu];
+  wakeidle(c, rq->len > 1 || c != mycpu());
+}
+
+// Take the next process off CPU c's run queue, or return 0;
+// real-time processes come first.
+// The caller must lock it and check that it is RUNNABLE.
+struct proc*
+runqpop(struct cpu *c)
+{
+  struct proc *p;
+
+  if((p = edfpop()) != 0)
+    return p;
+  acquire(&c->rq.lock);
+  p = rqdequeue(&c->rq);
+  release(&c->rq.lock);
+  return p;
+}
+
+// The CPU other than c with the longest run queue, by an
+// unlocked look, or 0 if all others are empty.
+static struct cpu*
+busiest(struct cpu *c)
+{
+  struct cpu *b, *best = 0;
+
+  for(b = cpus; b < &cpus[NCPU]; b++){
+    if(b != c && b->rq.len > 0 && (best == 0 || b->rq.len > best->rq.len))
+      best = b;
+  }
+  return best;
+}
+
+// Called by CPU c, whose run queue is empty: take a process
+// from the longest run queue, or return 0. As with runqpop(),
+// the caller must lock it and check that it is RUNNABLE.
+struct proc*
+runqsteal(struct cpu *c)
+{
+  struct cpu *b;
+  struct proc *p;
+
+  if((b = busiest(c)) == 0)
+    return 0;
+  acquire(&b->rq.lock);
+  p = rqdequeue(&b->rq);
+  if(p){
+    rqmigrate(p, &b->rq, &c->rq);
+    c->rq.nsteal++;
+  }
+  release(&b->rq.lock);
+  return p;
+}
+
+// Pull processes from the longest run queue to c's until
+// the two lengths are within one.
+static void
+runqbalance(struct cpu *c)
+{
+  struct runq *first, *second, *from;
+  struct cpu *b;
+  struct proc *p;
+
+  if((b = busiest(c)) == 0 || b->rq.len - c->rq.len < 2)
+    return;
+
+  from = &b->rq;
+  first = b < c ? &b->rq : &c->rq;
+  second = b < c ? &c->rq : &b->rq;
+  acquire(&first->lock);
+  acquire(&second->lock);
+  while(from->len - c->rq.len >= 2 && (p = rqdequeue(from)) != 0){
+    rqmigrate(p, from, &c->rq);
+    rqenqueue(&c->rq, p);
+    c->rq.nmoved++;
+  }
+  release(&second->lock);
+  release(&first->lock);
+}
+
+#ifdef SCHED_MLFQ
+// Move every process on rq to its top level, keeping
+// their order. Caller must hold rq->lock.
+static void
+rqboost(struct runq *rq)
+{
+  struct proc *p, *list;
+  int n = rq->len;
+
+  list = 0;
+  for(int i = NPRIO-1; i >= 0; i--){
+    if(rq->tail[i]){
+      rq->tail[i]->rqnext = list;
+      list = rq->head[i];
+    }
+    rq->head[i] = rq->tail[i] = 0;
+  }
+  // walk from the old top level down.
+  rq->len = 0;
+  while((p = list) != 0){
+    list = p->rqnext;
+    p->boost = boost;
+    p->prio = baseprio(p);
+    p->slice = 0;
+    rqenqueue(rq, p);
+  }
+  rq->nenq -= n;
+}
+#endif
+
+// Called by scheduler() on CPU c when there is nothing to
+// run: wait for an interrupt. Look for work once more after
+// saying c is idle, so that either this CPU sees work queued
+// from now on or the CPU queueing it sees c->idle and sends
+// an IPI. Interrupts stay off until after the wfi, which
+// wakes up for a pending interrupt anyway, so the IPI can't
+// be taken too early and missed.
+//
+// An idle CPU takes no timer ticks: it puts off its next
+// timer interrupt until one of its timers or a throttled
+// real-time process is due, and picks the ticks up again
+// after.
+void
+cpuidle(struct cpu *c)
+{
+  uint64 t0;
+
+  intr_off();
+  c->idle = 1;
+  __sync_synchronize();
+  if(c->rq.len == 0 && !edfwaiting() && busiest(c) == 0){
+    timerarm(1);
+    t0 = r_time();
+    wfi();
+    c->idletime += r_time() - t0;
+    timerarm(0);
+  }
+  c->idle = 0;
+  intr_on();
+}
+
+// Called on every CPU at every timer tick, with
+// interrupts off.
+void
+schedtick(void)
+{
+  struct cpu *c = mycpu();
+
+  if(++c->rq.ticks % BALANCE_TICKS == 0)
+    runqbalance(c);
+#ifdef SCHED_MLFQ
+  if(ticks / BOOST_TICKS != boost)
+    boost = ticks / BOOST_TICKS;
+  if(c->rq.boost != boost){
+    acquire(&c->rq.lock);
+    rqboost(&c->rq);
+    c->rq.boost = boost;
+    release(&c->rq.lock);
+  }
+#endif
+}
+
+// Charge running process p for a timer tick under the
+// build's policy. Returns 1 if p should give up the CPU.
+static int
+policyslice(struct proc *p)
+{
+#ifdef SCHED_MLFQ
+  struct runq *rq;
+  int i;
+
+  mlfqrefresh(p);
+  if(++p->slice >= slice[p->prio]){
+    if(p->prio < NPRIO-1)
+      p->prio++;
+    p->slice = 0;
+    return 1;
+  }
+
+  // stay on, unless a higher level has work waiting here.
+  push_off();
+  rq = &mycpu()->rq;
+  for(i = 0; i < p->prio; i++){
+    if(rq->head[i])
+      break;
+  }
+  pop_off();
+  return i < p->prio;
+#elif defined(SCHED_CFS)
+  struct runq *rq;
+  int preempt;
+
+  // p->nice is read without p->lock; a stale value
+  // only mischarges this tick.
+  p->vruntime += NICE0_WEIGHT * NICE0_WEIGHT / weights[p->nice - NICE_MIN];
+
+  // give way to a process that has had less.
+  push_off();
+  rq = &mycpu()->rq;
+  acquire(&rq->lock);
+  rqsetmin(rq, p->vruntime);
+  preempt = rq->len > 0 && rq->heap[0]->vruntime < p->vruntime;
+  release(&rq->lock);
+  pop_off();
+  return preempt;
+#else
+  return 1;
+#endif
+}
+
+// Charge the current process for a timer tick.
+// Returns 1 if it should give up the CPU.
+int
+timeslice(void)
+{
+  struct proc *p = myproc();
+
+  // real-time processes run ahead of all others, until their
+  // budget is gone or an earlier deadline is waiting.
+  if(p->dl_runtime)
+    return edfpreempt(p);
+  if(policyslice(p))
+    return 1;
+  return edfwaiting();
+}
+
+// Report each CPU's queue length and enqueue/dequeue counts,
+// how much work it has taken from other CPUs, and how long
+// it has been idle.
+int
+schedstats(char *buf, int sz)
+{
+  struct runq *rq;
+  int n = 0;
+
+  for(int i = 0; i < NCPU; i++){
+    rq = &cpus[i].rq;
+    n += snprintf(buf+n, sz-n, "sched: cpu %d runq len %d enq %ld deq %ld steal %ld moved %ld idle %ld ms\n",
+                  i, rq->len, rq->nenq, rq->ndeq, rq->nsteal, rq->nmoved,
+                  cpus[i].idletime / (CLINT_HZ / 1000));
+  }
+  return n;
+}
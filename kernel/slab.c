@@ -0,0 +1,270 @@
+//
+// Slab allocator for fixed-size kernel objects.
+//
+// A kmem_cache hands out objects of one size. It carves them
+// out of slabs, each a page from kalloc() that starts with a
+// struct slab header, so kmem_cache_free() finds an object's
+// slab by rounding its address down to a page.
+//
+// Each CPU keeps a magazine of free objects in front of the
+// slabs, so that allocation and freeing normally touch only
+// that CPU's magazine lock. An empty magazine refills half
+// full from the slabs; a full one gives half back.
+//
+// Slabs with no objects in use are kept, up to one per cache,
+// for the next allocation. When kalloc() runs out of pages it
+// calls slabreclaim(), which empties the magazines and gives
+// every unused slab back.
+//
+// Locking: a magazine's lock before its cache's lock. No
+// slab lock is held while calling kalloc(), so that
+// slabreclaim() can take any of them.
+//
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "spinlock.h"
+#include "riscv.h"
+#include "slab.h"
+#include "defs.h"
+
+struct slab {
+  struct slab *next;          // on cache->slabs, if any object is free
+  struct slab *prev;
+  struct kmem_cache *cache;
+  void *freelist;             // free objects, linked through their first word
+  int nfree;
+  int onlist;
+};
+
+#define SLABHDR ((sizeof(struct slab) + 15) & ~15)
+
+// all caches, for statistics and reclaim. caches are
+// created while booting, before other CPUs start.
+static struct kmem_cache *caches;
+
+// Set up cache c for objects of size bytes.
+void
+kmem_cache_init(struct kmem_cache *c, char *name, uint size)
+{
+  size = (size + 7) & ~7;
+  if(size < sizeof(void*) || size > PGSIZE - SLABHDR)
+    panic("kmem_cache_init");
+  c->name = name;
+  c->size = size;
+  c->perslab = (PGSIZE - SLABHDR) / size;
+  initlock(&c->lock, "kmem_cache");
+  for(int i = 0; i < NCPU; i++)
+    initlock(&c->mag[i].lock, "magazine");
+  c->next = caches;
+  caches = c;
+}
+
+static void
+slablink(struct kmem_cache *c, struct slab *s)
+{
+  s->prev = 0;
+  s->next = c->slabs;
+  if(s->next)
+    s->next->prev = s;
+  c->slabs = s;
+  s->onlist = 1;
+}
+
+static void
+slabunlink(struct kmem_cache *c, struct slab *s)
+{
+  if(s->prev)
+    s->prev->next = s->next;
+  else
+    c->slabs = s->next;
+  if(s->next)
+    s->next->prev = s->prev;
+  s->onlist = 0;
+}
+
+// Take up to n free objects from c's slabs into objs.
+// Caller must hold c->lock. Returns the number taken.
+static int
+slabget(struct kmem_cache *c, void **objs, int n)
+{
+  struct slab *s;
+  int got;
+
+  for(got = 0; got < n && (s = c->slabs) != 0; ){
+    if(s->nfree == c->perslab)
+      c->nempty--;
+    while(got < n && s->nfree > 0){
+      objs[got++] = s->freelist;
+      s->freelist = *(void**)s->freelist;
+      s->nfree--;
+    }
+    if(s->nfree == 0)
+      slabunlink(c, s);
+  }
+  return got;
+}
+
+// Give slab s, which has no objects in use, back to kalloc().
+// Caller must hold c->lock.
+static void
+slabdestroy(struct kmem_cache *c, struct slab *s)
+{
+  slabunlink(c, s);
+  c->nempty--;
+  c->nslabs--;
+  kfree((void*)s);
+}
+
+// Return n objects to their slabs.
+// Caller must hold c->lock.
+static void
+slabput(struct kmem_cache *c, void **objs, int n)
+{
+  struct slab *s;
+
+  for(int i = 0; i < n; i++){
+    s = (struct slab*)PGROUNDDOWN((uint64)objs[i]);
+    if(s->cache != c)
+      panic("kmem_cache_free: wrong cache");
+    *(void**)objs[i] = s->freelist;
+    s->freelist = objs[i];
+    s->nfree++;
+    if(!s->onlist)
+      slablink(c, s);
+    if(s->nfree == c->perslab){
+      c->nempty++;
+      if(c->nempty > 1)
+        slabdestroy(c, s);
+    }
+  }
+}
+
+// Add a new slab to c. Returns 0, or -1 if out of memory.
+static int
+slabgrow(struct kmem_cache *c)
+{
+  struct slab *s;
+  char *obj;
+
+  if((s = (struct slab*)kalloc()) == 0)
+    return -1;
+  s->cache = c;
+  s->freelist = 0;
+  s->nfree = c->perslab;
+  for(int i = c->perslab - 1; i >= 0; i--){
+    obj = (char*)s + SLABHDR + i*c->size;
+    *(void**)obj = s->freelist;
+    s->freelist = obj;
+  }
+
+  acquire(&c->lock);
+  slablink(c, s);
+  c->nslabs++;
+  c->nempty++;
+  release(&c->lock);
+  return 0;
+}
+
+// Allocate an object from c.
+// Returns 0 if out of memory.
+void*
+kmem_cache_alloc(struct kmem_cache *c)
+{
+  struct magazine *m;
+  void *obj;
+
+  for(;;){
+    push_off();
+    m = &c->mag[cpuid()];
+    acquire(&m->lock);
+    if(m->n == 0){
+      acquire(&c->lock);
+      m->n = slabget(c, m->objs, MAGSIZE/2);
+      release(&c->lock);
+    }
+    obj = 0;
+    if(m->n > 0)
+      obj = m->objs[--m->n];
+    release(&m->lock);
+    pop_off();
+
+    if(obj){
+      __sync_fetch_and_add(&c->nalloc, 1);
+      return obj;
+    }
+    if(slabgrow(c) < 0)
+      return 0;
+  }
+}
+
+// Free obj, which kmem_cache_alloc(c) returned.
+void
+kmem_cache_free(struct kmem_cache *c, void *obj)
+{
+  struct magazine *m;
+
+  push_off();
+  m = &c->mag[cpuid()];
+  acquire(&m->lock);
+  if(m->n == MAGSIZE){
+    acquire(&c->lock);
+    slabput(c, m->objs + MAGSIZE/2, MAGSIZE/2);
+    release(&c->lock);
+    m->n = MAGSIZE/2;
+  }
+  m->objs[m->n++] = obj;
+  release(&m->lock);
+  pop_off();
+
+  __sync_fetch_and_add(&c->nfree, 1);
+}
+
+// Empty every magazine of every cache and give all slabs
+// with no objects in use back to kalloc().
+// Returns the number of pages freed.
+int
+slabreclaim(void)
+{
+  struct kmem_cache *c;
+  struct magazine *m;
+  struct slab *s, *next;
+  int n = 0;
+
+  for(c = caches; c; c = c->next){
+    for(m = c->mag; m < &c->mag[NCPU]; m++){
+      acquire(&m->lock);
+      acquire(&c->lock);
+      slabput(c, m->objs, m->n);
+      release(&c->lock);
+      m->n = 0;
+      release(&m->lock);
+    }
+    acquire(&c->lock);
+    for(s = c->slabs; s; s = next){
+      next = s->next;
+      if(s->nfree == c->perslab){
+        slabdestroy(c, s);
+        n++;
+      }
+    }
+    release(&c->lock);
+  }
+  return n;
+}
+
+// Report each cache's object size, objects in use, and slabs.
+int
+slabstats(char *buf, int sz)
+{
+  struct kmem_cache *c;
+  int n = 0;
+
+  for(c = caches; c; c = c->next){
+    n += snprintf(buf+n, sz-n, "slab: %s size %d inuse %ld slabs %d (%d empty) allocs %ld\n",
+                  c->name, c->size, c->nalloc - c->nfree, c->nslabs, c->nempty,
+                  c->nalloc);
+  }
+  return n;
+}
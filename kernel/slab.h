@@ -0,0 +1,24 @@
+// Object caches for fixed-size kernel objects; see slab.c.
+
+#define MAGSIZE 16  // objects a CPU's magazine holds
+
+// a CPU's stack of free objects, in front of the slabs.
+struct magazine {
+  struct spinlock lock;
+  int n;
+  void *objs[MAGSIZE];
+};
+
+struct kmem_cache {
+  char *name;
+  uint size;                  // bytes per object
+  int perslab;                // objects per slab
+  struct spinlock lock;       // protects the slab list and counts below
+  struct slab *slabs;         // slabs with free objects
+  int nslabs;                 // all slabs, full or not
+  int nempty;                 // slabs with no objects in use
+  uint64 nalloc;              // objects allocated, ever
+  uint64 nfree;               // objects freed, ever
+  struct magazine mag[NCPU];
+  struct kmem_cache *next;    // on the list of all caches
+};
@@ -0,0 +1,109 @@
+//
+// formatted output into a buffer -- snprintf.
+// used to build the text served by the statistics device.
+//
+
+#include <stdarg.h>
+
+#include "types.h"
+#include "param.h"
+#include "spinlock.h"
+#include "riscv.h"
+#include "defs.h"
+
+static char digits[] = "0123456789abcdef";
+
+static int
+sputc(char *s, char c)
+{
+  *s = c;
+  return 1;
+}
+
+static int
+sprintint(char *s, int sz, uint64 x, int base, int neg)
+{
+  char buf[24];
+  int i, n;
+
+  i = 0;
+  do {
+    buf[i++] = digits[x % base];
+  } while((x /= base) != 0);
+
+  if(neg)
+    buf[i++] = '-';
+
+  n = 0;
+  while(--i >= 0 && n < sz)
+    n += sputc(s+n, buf[i]);
+  return n;
+}
+
+// Print to the buffer buf of size sz.
+// only understands %d, %x, %p, %s, and %ld.
+// Always nul-terminates; returns the number of
+// characters written, not counting the nul.
+int
+snprintf(char *buf, int sz, char *fmt, ...)
+{
+  va_list ap;
+  int i, c, n;
+  long l;
+  char *s;
+
+  if(fmt == 0)
+    panic("null fmt");
+  if(sz <= 0)
+    return 0;
+  sz--; // room for the nul
+
+  n = 0;
+  va_start(ap, fmt);
+  for(i = 0; (c = fmt[i] & 0xff) != 0 && n < sz; i++){
+    if(c != '%'){
+      n += sputc(buf+n, c);
+      continue;
+    }
+    c = fmt[++i] & 0xff;
+    if(c == 0)
+      break;
+    switch(c){
+    case 'd':
+      l = va_arg(ap, int);
+      n += sprintint(buf+n, sz-n, l < 0 ? -l : l, 10, l < 0);
+      break;
+    case 'l':
+      if((fmt[i+1] & 0xff) == 'd')
+        i++;
+      l = va_arg(ap, long);
+      n += sprintint(buf+n, sz-n, l < 0 ? -l : l, 10, l < 0);
+      break;
+    case 'x':
+      n += sprintint(buf+n, sz-n, va_arg(ap, uint), 16, 0);
+      break;
+    case 'p':
+      n += sprintint(buf+n, sz-n, va_arg(ap, uint64), 16, 0);
+      break;
+    case 's':
+      if((s = va_arg(ap, char*)) == 0)
+        s = "(null)";
+      for(; *s && n < sz; s++)
+        n += sputc(buf+n, *s);
+      break;
+    case '%':
+      n += sputc(buf+n, '%');
+      break;
+    default:
+      // Print unknown % sequence to draw attention.
+      n += sputc(buf+n, '%');
+      if(n < sz)
+        n += sputc(buf+n, c);
+      break;
+    }
+  }
+  va_end(ap);
+
+  buf[n] = 0;
+  return n;
+}
@@ -0,0 +1,73 @@
+//
+// The statistics device: reading "statistics" returns a
+// text snapshot of kernel counters, one subsystem per
+// section. Each read builds a fresh snapshot and returns
+// it from the open file's offset, so readers don't share
+// any state; reopen the file (or read it whole in one go)
+// for a consistent view.
+//
+
+#include "types.h"
+#include "param.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "file.h"
+#include "riscv.h"
+#include "defs.h"
+
+#define STATSBUF PGSIZE
+#define TRUNCATED "stats: truncated\n"
+
+// Ask each subsystem to append its counters to buf, and
+// say so at the end if they didn't all fit.
+static int
+statscopyin(char *buf, int sz)
+{
+  int n = 0;
+
+  // keep room for TRUNCATED and its nul.
+  sz -= sizeof(TRUNCATED) - 1;
+  n += kallocstats(buf+n, sz-n);
+  n += vmstats(buf+n, sz-n);
+  n += procstats(buf+n, sz-n);
+  n += slabstats(buf+n, sz-n);
+  n += schedstats(buf+n, sz-n);
+  n += edfstats(buf+n, sz-n);
+  n += ipistats(buf+n, sz-n);
+  if(n >= sz - 1)
+    n += snprintf(buf+n, sizeof(TRUNCATED), TRUNCATED);
+  return n;
+}
+
+// user read()s from the statistics device go here.
+int
+statsread(int user_dst, uint64 dst, uint off, int n)
+{
+  char *buf;
+  int sz, m;
+
+  if((buf = kalloc()) == 0)
+    return -1;
+  sz = statscopyin(buf, STATSBUF);
+
+  m = 0;
+  if(off < sz){
+    m = sz - off;
+    if(m > n)
+      m = n;
+    if(either_copyout(user_dst, dst, buf+off, m) == -1)
+      m = -1;
+  }
+
+  kfree(buf);
+  return m;
+}
+
+void
+statsinit(void)
+{
+  devsw[STATS].read = 0;
+  devsw[STATS].pread = statsread;
+  devsw[STATS].write = 0;
+}
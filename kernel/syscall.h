@@ -20,3 +20,15 @@
 #define SYS_link   19
 #define SYS_mkdir  20
 #define SYS_close  21
+#define SYS_mmap   22
+#define SYS_munmap 23
+#define SYS_setpriority 24
+#define SYS_sched_deadline 25
+#define SYS_nanosleep 26
+#define SYS_futex_wait 27
+#define SYS_futex_wake 28
+#define SYS_clone  29
+#define SYS_join   30
+#define SYS_fcntl  31
+#define SYS_poll   32
+#define SYS_texit  33
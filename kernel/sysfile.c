@@ -17,20 +17,29 @@
 #include "fcntl.h"
 
 // Fetch the nth word-sized system call argument as a file descriptor
-// and return both the descriptor and the corresponding struct file.
+// and return both the descriptor and the corresponding struct file,
+// with a reference to it that the caller must fileclose(), since
+// another thread may close the descriptor meanwhile.
 static int
 argfd(int n, int *pfd, struct file **pf)
 {
   int fd;
   struct file *f;
+  struct fdtable *fdt = myproc()->fdt;
 
   argint(n, &fd);
-  if(fd < 0 || fd >= NOFILE || (f=myproc()->ofile[fd]) == 0)
+  if(fd < 0 || fd >= NOFILE)
     return -1;
+  acquire(&fdt->lock);
+  if((f = fdt->ofile[fd]) == 0){
+    release(&fdt->lock);
+    return -1;
+  }
+  filedup(f);
+  release(&fdt->lock);
   if(pfd)
     *pfd = fd;
-  if(pf)
-    *pf = f;
+  *pf = f;
   return 0;
 }
 
@@ -40,71 +49,136 @@ static int
 fdalloc(struct file *f)
 {
   int fd;
-  struct proc *p = myproc();
+  struct fdtable *fdt = myproc()->fdt;
 
+  // another thread may be allocating one too.
+  acquire(&fdt->lock);
   for(fd = 0; fd < NOFILE; fd++){
-    if(p->ofile[fd] == 0){
-      p->ofile[fd] = f;
+    if(fdt->ofile[fd] == 0){
+      fdt->ofile[fd] = f;
+      release(&fdt->lock);
       return fd;
     }
   }
+  release(&fdt->lock);
   return -1;
 }
 
+// Clear file descriptor fd and close f, its file, unless
+// another thread has closed fd first.
+// Returns 0, or -1 if fd no longer refers to f.
+static int
+fdclose(int fd, struct file *f)
+{
+  struct fdtable *fdt = myproc()->fdt;
+
+  acquire(&fdt->lock);
+  if(fdt->ofile[fd] != f){
+    release(&fdt->lock);
+    return -1;
+  }
+  fdt->ofile[fd] = 0;
+  release(&fdt->lock);
+  fileclose(f);
+  return 0;
+}
+
 uint64
 sys_dup(void)
 {
   struct file *f;
   int fd;
 
+  // argfd()'s reference becomes the new descriptor's.
   if(argfd(0, 0, &f) < 0)
     return -1;
-  if((fd=fdalloc(f)) < 0)
+  if((fd=fdalloc(f)) < 0){
+    fileclose(f);
     return -1;
-  filedup(f);
+  }
   return fd;
 }
 
+// Read (or, if write, write) n bytes between f and user
+// address p. fileread() and filewrite() copy while holding
+// locks, under which pages can't be faulted in from a file,
+// so mmap()ed pages are faulted in first. An inode's data
+// is moved a page at a time, faulting in just the page
+// about to be copied, and stopping at the first short
+// transfer, so that a large buffer costs only what is
+// used. A pipe or device may block again if asked for
+// more, so gets one call.
+static int
+filerw(struct file *f, uint64 p, int n, int write)
+{
+  pagetable_t pagetable = myproc()->mm->pagetable;
+  int tot, m, r;
+
+  if(n <= 0 || f->type != FD_INODE){
+    if(n > 0)
+      uvmprefault(pagetable, p, n, !write);
+    return write ? filewrite(f, p, n) : fileread(f, p, n);
+  }
+
+  tot = 0;
+  while(tot < n){
+    m = PGSIZE - (p + tot) % PGSIZE;
+    if(m > n - tot)
+      m = n - tot;
+    uvmprefault(pagetable, p + tot, m, !write);
+    if((r = write ? filewrite(f, p + tot, m) : fileread(f, p + tot, m)) < 0)
+      return tot > 0 ? tot : -1;
+    tot += r;
+    if(r < m)
+      break;
+  }
+  return tot;
+}
+
 uint64
 sys_read(void)
 {
   struct file *f;
-  int n;
+
+  int n, r;
   uint64 p;
 
   argaddr(1, &p);
   argint(2, &n);
   if(argfd(0, 0, &f) < 0)
     return -1;
-  return fileread(f, p, n);
+  r = filerw(f, p, n, 0);
+  fileclose(f);
+  return r;
 }
 
 uint64
 sys_write(void)
 {
   struct file *f;
-  int n;
+  int n, r;
   uint64 p;
   
   argaddr(1, &p);
   argint(2, &n);
   if(argfd(0, 0, &f) < 0)
     return -1;
-
-  return filewrite(f, p, n);
+  r = filerw(f, p, n, 1);
+  fileclose(f);
+  return r;
 }
 
 uint64
 sys_close(void)
 {
-  int fd;
+  int fd, r;
   struct file *f;
 
   if(argfd(0, &fd, &f) < 0)
     return -1;
-  myproc()->ofile[fd] = 0;
+  r = fdclose(fd, f);
   fileclose(f);
-  return 0;
+  return r;
 }
 
 uint64
@@ -112,11 +186,14 @@ sys_fstat(void)
 {
   struct file *f;
   uint64 st; // user pointer to struct stat
+  int r;
 
   argaddr(1, &st);
   if(argfd(0, 0, &f) < 0)
     return -1;
-  return filestat(f, st);
+  r = filestat(f, st);
+  fileclose(f);
+  return r;
 }
 
 // Create the path new as a link to the same inode as old.
@@ -359,6 +436,7 @@ sys_open(void)
   f->ip = ip;
   f->readable = !(omode & O_WRONLY);
   f->writable = (omode & O_WRONLY) || (omode & O_RDWR);
+  f->nonblock = (omode & O_NONBLOCK) != 0;
 
   if((omode & O_TRUNC) && ip->type == T_FILE){
     itrunc(ip);
@@ -488,18 +566,114 @@ sys_pipe(void)
   fd0 = -1;
   if((fd0 = fdalloc(rf)) < 0 || (fd1 = fdalloc(wf)) < 0){
     if(fd0 >= 0)
-      p->ofile[fd0] = 0;
-    fileclose(rf);
+      fdclose(fd0, rf);
+    else
+      fileclose(rf);
     fileclose(wf);
     return -1;
   }
-  if(copyout(p->pagetable, fdarray, (char*)&fd0, sizeof(fd0)) < 0 ||
-     copyout(p->pagetable, fdarray+sizeof(fd0), (char *)&fd1, sizeof(fd1)) < 0){
-    p->ofile[fd0] = 0;
-    p->ofile[fd1] = 0;
-    fileclose(rf);
-    fileclose(wf);
+  if(copyout(p->mm->pagetable, fdarray, (char*)&fd0, sizeof(fd0)) < 0 ||
+     copyout(p->mm->pagetable, fdarray+sizeof(fd0), (char *)&fd1, sizeof(fd1)) < 0){
+    fdclose(fd0, rf);
+    fdclose(fd1, wf);
     return -1;
   }
   return 0;
 }
+
+uint64
+sys_mmap(void)
+{
+  uint64 addr, len, r;
+  int prot, flags, off;
+  struct file *f;
+
+  argaddr(0, &addr);  // a hint; ignored
+  argaddr(1, &len);
+  argint(2, &prot);
+  argint(3, &flags);
+  argint(5, &off);
+  if(off < 0 || argfd(4, 0, &f) < 0)
+    return -1;
+  r = mmap(f, len, prot, flags, off);
+  fileclose(f);
+  return r;
+}
+
+uint64
+sys_munmap(void)
+{
+  uint64 addr, len;
+
+  argaddr(0, &addr);
+  argaddr(1, &len);
+  return munmap(addr, len);
+}
+
+// Get or set an open file's flags. Only O_NONBLOCK can
+// be changed; it is shared by every descriptor of the file.
+uint64
+sys_fcntl(void)
+{
+  struct file *f;
+  int cmd, arg, r;
+
+  argint(1, &cmd);
+  argint(2, &arg);
+  if(argfd(0, 0, &f) < 0)
+    return -1;
+  r = -1;
+  if(cmd == F_GETFL){
+    r = f->readable ? (f->writable ? O_RDWR : O_RDONLY) : O_WRONLY;
+    if(f->nonblock)
+      r |= O_NONBLOCK;
+  } else if(cmd == F_SETFL){
+    f->nonblock = (arg & O_NONBLOCK) != 0;
+    r = 0;
+  }
+  fileclose(f);
+  return r;
+}
+
+// Wait for any of an array of descriptors to be ready for
+// reading or writing, for at most a number of milliseconds
+// (no limit if negative).
+uint64
+sys_poll(void)
+{
+  uint64 addr;
+  int n, ms, i, r;
+  struct pollfd pfds[NOFILE];
+  struct file *files[NOFILE];
+  struct proc *p = myproc();
+
+  argaddr(0, &addr);
+  argint(1, &n);
+  argint(2, &ms);
+  if(n < 0 || n > NOFILE)
+    return -1;
+  if(copyin(p->mm->pagetable, (char*)pfds, addr, n * sizeof(pfds[0])) < 0)
+    return -1;
+  // hold a reference to each file while waiting, in case
+  // another thread closes its descriptor.
+  acquire(&p->fdt->lock);
+  for(i = 0; i < n; i++){
+    if(pfds[i].fd < 0 || pfds[i].fd >= NOFILE || (files[i] = p->fdt->ofile[pfds[i].fd]) == 0)
+      break;
+    filedup(files[i]);
+  }
+  release(&p->fdt->lock);
+  if(i < n){
+    while(--i >= 0)
+      fileclose(files[i]);
+    return -1;
+  }
+  r = filepoll(files, pfds, n, ms);
+  for(i = 0; i < n; i++)
+    fileclose(files[i]);
+  if(r < 0)
+    return -1;
+  if(copyout(p->mm->pagetable, addr, (char*)pfds, n * sizeof(pfds[0])) < 0)
+    return -1;
+  return r;
+}
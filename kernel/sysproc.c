@@ -35,6 +35,37 @@ sys_wait(void)
   return wait(p);
 }
 
+uint64
+sys_clone(void)
+{
+  uint64 fn, arg, stack;
+
+  argaddr(0, &fn);
+  argaddr(1, &arg);
+  argaddr(2, &stack);
+  return clone(fn, arg, stack);
+}
+
+uint64
+sys_join(void)
+{
+  int tid;
+  uint64 p;
+
+  argint(0, &tid);
+  argaddr(1, &p);
+  return join(tid, p);
+}
+
+uint64
+sys_texit(void)
+{
+  int n;
+  argint(0, &n);
+  texit(n);
+  return 0;  // not reached
+}
+
 uint64
 sys_sbrk(void)
 {
@@ -42,8 +73,7 @@ sys_sbrk(void)
   int n;
 
   argint(0, &n);
-  addr = myproc()->sz;
-  if(growproc(n) < 0)
+  if(growproc(n, &addr) < 0)
     return -1;
   return addr;
 }
@@ -52,20 +82,48 @@ uint64
 sys_sleep(void)
 {
   int n;
-  uint ticks0;
 
   argint(0, &n);
-  acquire(&tickslock);
-  ticks0 = ticks;
-  while(ticks - ticks0 < n){
-    if(killed(myproc())){
-      release(&tickslock);
-      return -1;
-    }
-    sleep(&ticks, &tickslock);
-  }
-  release(&tickslock);
-  return 0;
+  if(n < 0)
+    n = 0;
+  return timersleep((uint64)n * TICKCYCLES);
+}
+
+// sleep for the given number of nanoseconds.
+uint64
+sys_nanosleep(void)
+{
+  uint64 ns;
+
+  argaddr(0, &ns);
+  return timersleep(ns / (1000000000 / CLINT_HZ));
+}
+
+// wait on a futex, for at most the given number of
+// nanoseconds, or with no limit if 0.
+uint64
+sys_futex_wait(void)
+{
+  uint64 addr, ns;
+  int val;
+
+  argaddr(0, &addr);
+  argint(1, &val);
+  argaddr(2, &ns);
+  if(ns > 0 && ns < 1000000000 / CLINT_HZ)
+    ns = 1000000000 / CLINT_HZ;
+  return futexwait(addr, val, ns / (1000000000 / CLINT_HZ));
+}
+
+uint64
+sys_futex_wake(void)
+{
+  uint64 addr;
+  int n;
+
+  argaddr(0, &addr);
+  argint(1, &n);
+  return futexwake(addr, n);
 }
 
 uint64
@@ -77,6 +135,29 @@ sys_kill(void)
   return kill(pid);
 }
 
+uint64
+sys_setpriority(void)
+{
+  int pid, nice;
+
+  argint(0, &pid);
+  argint(1, &nice);
+  return setpriority(pid, nice);
+}
+
+// make the caller a real-time process that needs runtime
+// ticks of CPU by deadline ticks into each period.
+uint64
+sys_sched_deadline(void)
+{
+  int runtime, period, deadline;
+
+  argint(0, &runtime);
+  argint(1, &period);
+  argint(2, &deadline);
+  return edfadmit(runtime, period, deadline);
+}
+
 // return how many clock tick interrupts have occurred
 // since start.
 uint64
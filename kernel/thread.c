@@ -0,0 +1,184 @@
+//
+// Threads: processes that share an address space and
+// open files.
+//
+// clone() makes a thread, a process whose struct mm (user
+// page table, size and memory regions) and struct fdtable
+// are its creator's. Each thread has its own kernel stack,
+// trapframe, current directory and pid, and is scheduled
+// on its own.
+//
+// Every thread's trapframe is mapped in the shared page
+// table, at THREADFRAME(p->tfslot); userret leaves its
+// address in sscratch for uservec.
+//
+// A thread leaves with texit(). exit() ends the whole
+// process: it kills the other threads, and the first thread,
+// the one that fork() made, waits for them before it exits
+// with exit()'s status, so that its parent's wait() sees the
+// process gone only once all of it is.
+//
+// A struct mm has two counts. users counts the threads that
+// haven't exited; the last one unmaps the memory regions,
+// which may sleep. ref counts the procs that still
+// hold the mm, zombies included; the last freeproc() frees
+// the page table and the memory, which must not sleep.
+//
+// Locking: p->lock before mm->lock.
+//
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "slab.h"
+#include "defs.h"
+
+struct kmem_cache mmcache;
+struct kmem_cache fdtcache;
+
+void
+threadinit(void)
+{
+  kmem_cache_init(&mmcache, "mm", sizeof(struct mm));
+  kmem_cache_init(&fdtcache, "fdtable", sizeof(struct fdtable));
+}
+
+// Make a new address space for p, with no user memory,
+// and p's trapframe in slot 0.
+// Returns 0 if there is no memory.
+struct mm*
+mmalloc(struct proc *p)
+{
+  struct mm *mm;
+
+  if((mm = kmem_cache_alloc(&mmcache)) == 0)
+    return 0;
+  memset(mm, 0, sizeof(*mm));
+  if((mm->pagetable = proc_pagetable(p)) == 0){
+    kmem_cache_free(&mmcache, mm);
+    return 0;
+  }
+  initlock(&mm->lock, "mm");
+  mm->ref = 1;
+  mm->users = 1;
+  mm->tfslots = 1;
+  return mm;
+}
+
+// Make np, a new thread, share mm: map np's trapframe in a
+// free slot of mm's page table.
+// Returns 0 on success, -1 if there are NTHREAD threads
+// already, or no memory.
+int
+mmshare(struct proc *np, struct mm *mm)
+{
+  int slot;
+
+  acquire(&mm->lock);
+  for(slot = 0; slot < NTHREAD; slot++){
+    if((mm->tfslots & (1 << slot)) == 0)
+      break;
+  }
+  if(slot == NTHREAD || mm->users == 0 ||
+     mappages(mm->pagetable, THREADFRAME(slot), PGSIZE,
+              (uint64)np->trapframe, PTE_R | PTE_W) < 0){
+    release(&mm->lock);
+    return -1;
+  }
+  mm->tfslots |= 1 << slot;
+  mm->ref++;
+  mm->users++;
+  release(&mm->lock);
+
+  np->mm = mm;
+  np->tfslot = slot;
+  return 0;
+}
+
+// p, a thread of p->mm, is exiting.
+// Returns 1 if it was the last, which must then unmap
+// p->mm's memory regions.
+int
+mmexit(struct proc *p)
+{
+  struct mm *mm = p->mm;
+  int last;
+
+  acquire(&mm->lock);
+  last = --mm->users == 0;
+  release(&mm->lock);
+  return last;
+}
+
+// Drop a proc's reference to mm, unmapping its trapframe
+// from slot. The last reference frees mm's page table and
+// user memory. Doesn't sleep, so may be called with p->lock
+// held.
+void
+mmput(struct mm *mm, int slot)
+{
+  int ref;
+
+  acquire(&mm->lock);
+  uvmunmap(mm->pagetable, THREADFRAME(slot), 1, 0);
+  mm->tfslots &= ~(1 << slot);
+  ref = --mm->ref;
+  release(&mm->lock);
+
+  if(ref == 0){
+    uvmunmap(mm->pagetable, TRAMPOLINE, 1, 0);
+    uvmfree(mm->pagetable, mm->sz);
+    kmem_cache_free(&mmcache, mm);
+  }
+}
+
+// An empty file descriptor table.
+// Returns 0 if there is no memory.
+struct fdtable*
+fdtalloc(void)
+{
+  struct fdtable *fdt;
+
+  if((fdt = kmem_cache_alloc(&fdtcache)) == 0)
+    return 0;
+  memset(fdt, 0, sizeof(*fdt));
+  initlock(&fdt->lock, "fdtable");
+  fdt->ref = 1;
+  return fdt;
+}
+
+// Another thread shares fdt.
+struct fdtable*
+fdtdup(struct fdtable *fdt)
+{
+  acquire(&fdt->lock);
+  fdt->ref++;
+  release(&fdt->lock);
+  return fdt;
+}
+
+// Drop a reference to fdt; the last one closes its files.
+// Closing a file may sleep, so with p->lock held this must
+// only be called on a table that has no files.
+void
+fdtput(struct fdtable *fdt)
+{
+  int ref;
+
+  acquire(&fdt->lock);
+  ref = --fdt->ref;
+  release(&fdt->lock);
+  if(ref > 0)
+    return;
+
+  for(int fd = 0; fd < NOFILE; fd++){
+    if(fdt->ofile[fd]){
+      fileclose(fdt->ofile[fd]);
+      fdt->ofile[fd] = 0;
+    }
+  }
+  kmem_cache_free(&fdtcache, fdt);
+}
@@ -0,0 +1,329 @@
+//
+// One-shot timers on a per-CPU hierarchical timer wheel.
+//
+// A timer expires when CLINT_MTIME passes t->expires; its
+// function is then called on the CPU whose wheel it is on.
+// Every process has one, p->timer, which timersleep() uses,
+// so expiry wakes just the process whose time is up.
+//
+// A wheel has NLEVEL levels of WHEELSIZE slots. A level-0
+// slot covers 2^GRAIN cycles of CLINT_MTIME, and a slot on
+// each level above covers a whole turn of the level below.
+// A timer goes on the lowest level whose turn reaches its
+// expiry; when level 0 wraps around, the next slot of level 1
+// is moved down, and so on up. A timer is run once its level-0
+// slot has fully passed, so never early and at most 2^GRAIN
+// cycles late.
+//
+// clockintr() calls timerrun() on each timer interrupt, and
+// programs the next interrupt for no later than timernext().
+//
+// Locking: a wheel's lock before p->lock. Timer functions
+// run with the wheel's lock held, so must not add or delete
+// timers.
+//
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "defs.h"
+
+#define GRAIN     7                   // a level-0 slot is 2^GRAIN cycles, 12.8us
+#define WHEELBITS 6
+#define WHEELSIZE (1 << WHEELBITS)
+#define NLEVEL    4
+#define MAXDELTA  (1L << (WHEELBITS*NLEVEL))  // slots the wheel can look ahead
+
+struct wheel {
+  struct spinlock lock;
+  uint64 clk;                         // next level-0 slot to run, in 2^GRAIN cycles
+  struct timer *slot[NLEVEL][WHEELSIZE];
+  int n;                              // timers on the wheel
+  uint64 nfired;                      // timers run, ever
+};
+
+static struct wheel wheels[NCPU];
+
+void
+wheelinit(void)
+{
+  for(int i = 0; i < NCPU; i++)
+    initlock(&wheels[i].lock, "wheel");
+}
+
+// Put t on the slot of w for its expiry.
+// Caller must hold w->lock.
+static void
+wheelinsert(struct wheel *w, struct timer *t)
+{
+  uint64 u = t->expires >> GRAIN, d;
+  struct timer **h;
+  int l;
+
+  if(u < w->clk)
+    u = w->clk;
+  d = u - w->clk;
+  for(l = 0; l < NLEVEL-1; l++){
+    if(d < (1L << (WHEELBITS*(l+1))))
+      break;
+  }
+  if(d >= MAXDELTA)
+    u = w->clk + MAXDELTA - 1;  // comes back down for another look
+  h = &w->slot[l][(u >> (WHEELBITS*l)) & (WHEELSIZE-1)];
+
+  t->prev = 0;
+  t->next = *h;
+  if(*h)
+    (*h)->prev = t;
+  *h = t;
+  t->head = h;
+}
+
+static void
+wheelunlink(struct timer *t)
+{
+  if(t->prev)
+    t->prev->next = t->next;
+  else
+    *t->head = t->next;
+  if(t->next)
+    t->next->prev = t->prev;
+  t->head = 0;
+}
+
+// Take the list in slot h off the wheel and return it.
+static struct timer*
+wheeltake(struct timer **h)
+{
+  struct timer *list = *h;
+
+  *h = 0;
+  for(struct timer *t = list; t; t = t->next)
+    t->head = 0;
+  return list;
+}
+
+// Put each timer on list back on w, or on *expired if its
+// level-0 slot is before w->clk. Caller must hold w->lock.
+static void
+wheelrefile(struct wheel *w, struct timer *list, struct timer **expired)
+{
+  struct timer *t;
+
+  while((t = list) != 0){
+    list = t->next;
+    if((t->expires >> GRAIN) < w->clk){
+      t->next = *expired;
+      *expired = t;
+    } else {
+      wheelinsert(w, t);
+    }
+  }
+}
+
+// Move w->clk up to target, gathering the timers whose
+// slots it passes on *expired. Caller must hold w->lock.
+static void
+wheeladvance(struct wheel *w, uint64 target, struct timer **expired)
+{
+  struct timer *list, *t;
+  int l, j;
+
+  if(w->n == 0 || target <= w->clk){
+    if(target > w->clk)
+      w->clk = target;
+    return;
+  }
+
+  if(target - w->clk > WHEELSIZE){
+    // far behind, e.g. after an idle CPU slept through its
+    // ticks: take everything off and refile it at target,
+    // rather than walk every slot in between.
+    list = 0;
+    for(l = 0; l < NLEVEL; l++){
+      for(j = 0; j < WHEELSIZE; j++){
+        while((t = w->slot[l][j]) != 0){
+          w->slot[l][j] = t->next;
+          t->head = 0;
+          t->next = list;
+          list = t;
+        }
+      }
+    }
+    w->clk = target;
+    wheelrefile(w, list, expired);
+    return;
+  }
+
+  while(w->clk < target){
+    // at the start of a turn, bring the next slot of
+    // the level above down, and so on up.
+    for(l = 1; l < NLEVEL; l++){
+      if((w->clk & ((1L << (WHEELBITS*l)) - 1)) != 0)
+        break;
+      j = (w->clk >> (WHEELBITS*l)) & (WHEELSIZE-1);
+      wheelrefile(w, wheeltake(&w->slot[l][j]), expired);
+    }
+    list = wheeltake(&w->slot[0][w->clk & (WHEELSIZE-1)]);
+    w->clk++;
+    wheelrefile(w, list, expired);
+  }
+}
+
+// Run the expired timers of this CPU's wheel, at CLINT_MTIME
+// now. Called from clockintr() with interrupts off.
+void
+timerrun(uint64 now)
+{
+  struct wheel *w = &wheels[cpuid()];
+  struct timer *expired = 0, *t;
+
+  acquire(&w->lock);
+  wheeladvance(w, now >> GRAIN, &expired);
+  while((t = expired) != 0){
+    expired = t->next;
+    w->n--;
+    w->nfired++;
+    t->fn(t);
+    // only now, so that timerdel() waits for fn to finish.
+    __sync_synchronize();
+    t->cpu = -1;
+  }
+  release(&w->lock);
+}
+
+// The CLINT_MTIME value by which this CPU must call
+// timerrun(), or ~0 if its wheel is empty. Interrupts
+// must be off.
+uint64
+timernext(void)
+{
+  struct wheel *w = &wheels[cpuid()];
+  uint64 best = ~0UL, u, base;
+  int l, i;
+
+  acquire(&w->lock);
+  if(w->n > 0){
+    for(i = 0; i < WHEELSIZE; i++){
+      u = w->clk + i;
+      if(w->slot[0][u & (WHEELSIZE-1)]){
+        best = (u + 1) << GRAIN;
+        break;
+      }
+    }
+    // a higher slot must come down when its turn starts.
+    // wheeladvance() does that as w->clk passes the turn's
+    // first level-0 slot, so ask to go just past it; if
+    // w->clk is at that slot now, the slot is due already.
+    for(l = 1; l < NLEVEL; l++){
+      base = w->clk >> (WHEELBITS*l);
+      i = (w->clk & ((1L << (WHEELBITS*l)) - 1)) == 0 ? 0 : 1;
+      for(; i <= WHEELSIZE; i++){
+        if(w->slot[l][(base + i) & (WHEELSIZE-1)]){
+          u = (((base + i) << (WHEELBITS*l)) + 1) << GRAIN;
+          if(u < best)
+            best = u;
+          break;
+        }
+      }
+    }
+  }
+  release(&w->lock);
+  return best;
+}
+
+// Start timer t, which must not be pending, on this CPU's
+// wheel. t->fn(t) will be called once CLINT_MTIME passes
+// expires. Takes effect no later than this CPU's next tick;
+// the caller may call timerarm() to be more precise.
+void
+timeradd(struct timer *t, uint64 expires)
+{
+  struct wheel *w;
+
+  push_off();
+  w = &wheels[cpuid()];
+  acquire(&w->lock);
+  pop_off();
+  t->expires = expires;
+  t->cpu = w - wheels;
+  wheelinsert(w, t);
+  w->n++;
+  release(&w->lock);
+}
+
+// Stop timer t if it is pending. Once this returns, t's
+// function isn't running, and won't be.
+// Returns 1 if it was pending, 0 if it had already run or
+// was never started.
+int
+timerdel(struct timer *t)
+{
+  struct wheel *w;
+  int cpu;
+
+  while((cpu = t->cpu) >= 0){
+    w = &wheels[cpu];
+    acquire(&w->lock);
+    if(t->cpu == cpu){
+      wheelunlink(t);
+      t->cpu = -1;
+      w->n--;
+      release(&w->lock);
+      return 1;
+    }
+    release(&w->lock);
+  }
+  return 0;
+}
+
+// p->timer's function: wake p, if it is still asleep on it.
+static void
+timerwake(struct timer *t)
+{
+  struct proc *p = t->arg;
+
+  acquire(&p->lock);
+  if(p->state == SLEEPING && p->chan == t)
+    setrunnable(p);
+  release(&p->lock);
+}
+
+// Sleep for the given number of CLINT_MTIME cycles.
+// Returns 0, or -1 if the process was killed first.
+int
+timersleep(uint64 cycles)
+{
+  struct proc *p = myproc();
+  struct timer *t = &p->timer;
+  struct wheel *w;
+  int cpu;
+
+  if(cycles == 0)
+    return 0;
+  t->fn = timerwake;
+  t->arg = p;
+  timeradd(t, r_time() + cycles);
+  timerarm(0);
+
+  // the timer can't run while we hold its wheel's lock,
+  // so the wakeup can't come between the check and the
+  // sleep.
+  if((cpu = t->cpu) < 0)
+    return 0;
+  w = &wheels[cpu];
+  acquire(&w->lock);
+  while(t->cpu == cpu){
+    if(killed(p)){
+      release(&w->lock);
+      timerdel(t);
+      return -1;
+    }
+    sleep(t, &w->lock);
+  }
+  release(&w->lock);
+  return 0;
+}
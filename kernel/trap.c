@@ -15,6 +15,7 @@ extern char trampoline[], uservec[], userret[];
 void kernelvec();
 
 extern int devintr();
+extern uint64 timer_scratch[NCPU][6];
 
 void
 trapinit(void)
@@ -65,6 +66,20 @@ usertrap(void)
     intr_on();
 
     syscall();
+  } else if(r_scause() == 12 || r_scause() == 13 || r_scause() == 15){
+    // page fault. vmfault() may have to read the page from
+    // a file, so enable interrupts, as for a system call.
+    uint64 scause = r_scause();
+    uint64 stval = r_stval();
+    int perm = scause == 12 ? PTE_X : scause == 13 ? PTE_R : PTE_W;
+
+    intr_on();
+
+    if(vmfault(p->mm->pagetable, stval, perm, 1) != 0){
+      printf("usertrap(): unexpected scause %p pid=%d\n", scause, p->pid);
+      printf("            sepc=%p stval=%p\n", p->trapframe->epc, stval);
+      setkilled(p);
+    }
   } else if((which_dev = devintr()) != 0){
     // ok
   } else {
@@ -76,8 +91,9 @@ usertrap(void)
   if(killed(p))
     exit(-1);
 
-  // give up the CPU if this is a timer interrupt.
-  if(which_dev == 2)
+  // give up the CPU if this timer interrupt ends the time slice,
+  // or another CPU asked.
+  if((which_dev == 2 && timeslice()) || which_dev == 3)
     yield();
 
   usertrapret();
@@ -120,13 +136,14 @@ usertrapret(void)
   w_sepc(p->trapframe->epc);
 
   // tell trampoline.S the user page table to switch to.
-  uint64 satp = MAKE_SATP(p->pagetable);
+  uint64 satp = MAKE_SATP(p->mm->pagetable);
 
   // jump to userret in trampoline.S at the top of memory, which 
-  // switches to the user page table, restores user registers,
-  // and switches to user mode with sret.
+  // switches to the user page table, restores user registers
+  // from this thread's trapframe, and switches to user mode
+  // with sret.
   uint64 trampoline_userret = TRAMPOLINE + (userret - trampoline);
-  ((void (*)(uint64))trampoline_userret)(satp);
+  ((void (*)(uint64, uint64))trampoline_userret)(satp, THREADFRAME(p->tfslot));
 }
 
 // interrupts and exceptions from kernel code go here via kernelvec,
@@ -150,8 +167,10 @@ kerneltrap()
     panic("kerneltrap");
   }
 
-  // give up the CPU if this is a timer interrupt.
-  if(which_dev == 2 && myproc() != 0 && myproc()->state == RUNNING)
+  // give up the CPU if this timer interrupt ends the time slice,
+  // or another CPU asked.
+  if(myproc() != 0 && myproc()->state == RUNNING &&
+     ((which_dev == 2 && timeslice()) || which_dev == 3))
     yield();
 
   // the yield() may have caused some traps to occur,
@@ -160,19 +179,77 @@ kerneltrap()
   w_sstatus(sstatus);
 }
 
+// Set this CPU's next timer interrupt for when
+// CLINT_MTIME reaches when.
 void
+timerset(uint64 when)
+{
+  *(volatile uint64*)CLINT_MTIMECMP(cpuid()) = when;
+}
+
+// Program this CPU's next timer interrupt: the next tick,
+// or the next timer on its wheel if that is sooner. An idle
+// CPU takes no ticks; it only wakes for its timers and for
+// throttled real-time processes.
+void
+timerarm(int idle)
+{
+  struct cpu *c;
+  uint64 when, now;
+  uint t;
+
+  push_off();
+  c = mycpu();
+  when = timernext();
+  if(idle){
+    if((t = edfnexttick()) != ~0 && (uint64)t * TICKCYCLES < when)
+      when = (uint64)t * TICKCYCLES;
+  } else {
+    now = r_time();
+    if(c->nexttick <= now)
+      c->nexttick = (now / TICKCYCLES + 1) * TICKCYCLES;
+    if(c->nexttick < when)
+      when = c->nexttick;
+  }
+  timerset(when);
+  pop_off();
+}
+
+// called on every CPU at every timer interrupt.
+// returns 1 if it was a tick, 0 if it was only
+// for the timer wheel.
+int
 clockintr()
 {
-  acquire(&tickslock);
-  ticks++;
-  wakeup(&ticks);
-  release(&tickslock);
+  struct cpu *c = mycpu();
+  uint64 now = r_time();
+  int tick;
+
+  timerrun(now);
+
+  tick = now >= c->nexttick;
+  if(tick){
+    // ticks follows CLINT_MTIME, so that it keeps counting
+    // while idle CPUs sleep through their ticks.
+    if(now / TICKCYCLES != ticks){
+      acquire(&tickslock);
+      if(now / TICKCYCLES > ticks)
+        ticks = now / TICKCYCLES;
+      release(&tickslock);
+    }
+    edftick();
+    schedtick();
+  }
+
+  timerarm(0);
+  return tick;
 }
 
 // check if it's an external interrupt or software interrupt,
 // and handle it.
 // returns 2 if timer interrupt,
-// 1 if other device,
+// 3 if another CPU asked for a reschedule, even along with a tick,
+// 1 if other device or IPI,
 // 0 if not recognized.
 int
 devintr()
@@ -202,18 +279,22 @@ devintr()
 
     return 1;
   } else if(scause == 0x8000000000000001L){
-    // software interrupt from a machine-mode timer interrupt,
-    // forwarded by timervec in kernelvec.S.
+    // software interrupt from a machine-mode timer interrupt
+    // or another CPU's IPI, forwarded by timervec in
+    // kernelvec.S.
 
-    if(cpuid() == 0){
-      clockintr();
-    }
-    
     // acknowledge the software interrupt by clearing
-    // the SSIP bit in sip.
+    // the SSIP bit in sip, before looking at the cause,
+    // so that a timer interrupt arriving now isn't lost.
     w_sip(r_sip() & ~2);
 
-    return 2;
+    // a tick and IPIs may share the one interrupt, since
+    // timervec has cleared MSIP either way; serve both.
+    int tick = __sync_lock_test_and_set(&timer_scratch[cpuid()][4], 0) != 0;
+    int r = ipiintr() ? 3 : 1;
+    if(tick && clockintr() && r != 3)
+      r = 2;
+    return r;
   } else {
     return 0;
   }
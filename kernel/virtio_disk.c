@@ -178,10 +178,11 @@ free_desc(int i)
   disk.desc[i].flags = 0;
   disk.desc[i].next = 0;
   disk.free[i] = 1;
-  wakeup(&disk.free[0]);
 }
 
-// free a chain of descriptors.
+// free a chain of descriptors, and wake a process
+// waiting for them: every chain is three long, and
+// that's all one request needs.
 static void
 free_chain(int i)
 {
@@ -194,6 +195,7 @@ free_chain(int i)
     else
       break;
   }
+  wakeupn(&disk.free[0], 1);
 }
 
 // allocate three descriptors (they need not be contiguous).
@@ -229,7 +231,7 @@ virtio_disk_rw(struct buf *b, int write)
     if(alloc3_desc(idx) == 0) {
       break;
     }
-    sleep(&disk.free[0], &disk.vdisk_lock);
+    sleep_excl(&disk.free[0], &disk.vdisk_lock);
   }
 
   // format the three descriptors.
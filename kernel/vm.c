@@ -3,6 +3,8 @@
 #include "memlayout.h"
 #include "elf.h"
 #include "riscv.h"
+#include "spinlock.h"
+#include "proc.h"
 #include "defs.h"
 #include "fs.h"
 
@@ -15,14 +17,24 @@ extern char etext[];  // kernel.ld sets this to end of kernel code.
 
 extern char trampoline[]; // trampoline.S
 
+// leaf PTEs kvmmap() has created at each level.
+static int kvmleaves[3];
+
+// user megapages that faults have mapped, and that
+// uvmsplit() has broken into pages, for vmstats().
+static uint64 nhuge, nsplit;
+
+// protects kernel_pagetable once other CPUs are using it,
+// for kvmmapstack() and kvmunmapstack().
+static struct spinlock kvmlock;
+
 // Make a direct-map page table for the kernel.
 pagetable_t
 kvmmake(void)
 {
   pagetable_t kpgtbl;
 
-  kpgtbl = (pagetable_t) kalloc();
-  memset(kpgtbl, 0, PGSIZE);
+  kpgtbl = (pagetable_t) kalloc_zeroed();
 
   // uart registers
   kvmmap(kpgtbl, UART0, UART0, PGSIZE, PTE_R | PTE_W);
@@ -33,6 +45,9 @@ kvmmake(void)
   // PLIC
   kvmmap(kpgtbl, PLIC, PLIC, 0x400000, PTE_R | PTE_W);
 
+  // CLINT, so that CPUs can interrupt each other.
+  kvmmap(kpgtbl, CLINT, CLINT, 0x10000, PTE_R | PTE_W);
+
   // map kernel text executable and read-only.
   kvmmap(kpgtbl, KERNBASE, KERNBASE, (uint64)etext-KERNBASE, PTE_R | PTE_X);
 
@@ -43,9 +58,9 @@ kvmmake(void)
   // the highest virtual address in the kernel.
   kvmmap(kpgtbl, TRAMPOLINE, (uint64)trampoline, PGSIZE, PTE_R | PTE_X);
 
-  // allocate and map a kernel stack for each process.
-  proc_mapstacks(kpgtbl);
-  
+  // kernel stacks are mapped as processes are created;
+  // see kvmmapstack().
+
   return kpgtbl;
 }
 
@@ -53,7 +68,15 @@ kvmmake(void)
 void
 kvminit(void)
 {
+  int pages;
+
+  initlock(&kvmlock, "kvm");
   kernel_pagetable = kvmmake();
+
+  pages = kvmleaves[0] + kvmleaves[1] * 512 + kvmleaves[2] * 512 * 512;
+  printf("kvm: %d gigapages, %d megapages, %d pages; %d leaf PTEs saved\n",
+         kvmleaves[2], kvmleaves[1], kvmleaves[0],
+         pages - kvmleaves[0] - kvmleaves[1] - kvmleaves[2]);
 }
 
 // Switch h/w page table register to the kernel's page table,
@@ -82,26 +105,69 @@ kvminithart()
 //   21..29 -- 9 bits of level-1 index.
 //   12..20 -- 9 bits of level-0 index.
 //    0..11 -- 12 bits of byte offset within the page.
+//
+// If a megapage or gigapage maps va, returns its PTE.
 pte_t *
 walk(pagetable_t pagetable, uint64 va, int alloc)
+{
+  return walklevel(pagetable, va, 0, alloc);
+}
+
+// Like walk(), but return the PTE at level (0, 1 or 2)
+// rather than at level 0, e.g. to map a megapage at level 1.
+pte_t *
+walklevel(pagetable_t pagetable, uint64 va, int level, int alloc)
 {
   if(va >= MAXVA)
     panic("walk");
 
-  for(int level = 2; level > 0; level--) {
-    pte_t *pte = &pagetable[PX(level, va)];
+  for(int l = 2; l > level; l--) {
+    pte_t *pte = &pagetable[PX(l, va)];
     if(*pte & PTE_V) {
+      if(PTE_LEAF(*pte))
+        return pte;
       pagetable = (pagetable_t)PTE2PA(*pte);
     } else {
-      if(!alloc || (pagetable = (pde_t*)kalloc()) == 0)
+      if(!alloc || (pagetable = (pde_t*)kalloc_zeroed()) == 0)
         return 0;
-      memset(pagetable, 0, PGSIZE);
       *pte = PA2PTE(pagetable) | PTE_V;
     }
   }
+  return &pagetable[PX(level, va)];
+}
+
+// Look up the leaf PTE that maps va, and set *level to its
+// level. If a page-table page on the way is missing, returns
+// 0 and sets *level to the level whose LEVELSIZE(*level)-byte
+// range around va is unmapped. Otherwise returns the PTE,
+// which may be invalid if *level is 0.
+static pte_t *
+walkleaf(pagetable_t pagetable, uint64 va, int *level)
+{
+  pte_t *pte;
+
+  if(va >= MAXVA)
+    panic("walkleaf");
+
+  for(*level = 2; *level > 0; (*level)--){
+    pte = &pagetable[PX(*level, va)];
+    if((*pte & PTE_V) == 0)
+      return 0;
+    if(PTE_LEAF(*pte))
+      return pte;
+    pagetable = (pagetable_t)PTE2PA(*pte);
+  }
   return &pagetable[PX(0, va)];
 }
 
+// The physical address of va's 4096-byte page, which the
+// leaf PTE pte at level maps.
+static uint64
+leafpa(pte_t pte, int level, uint64 va)
+{
+  return PTE2PA(pte) + (va & (LEVELSIZE(level) - 1) & ~(PGSIZE - 1));
+}
+
 // Look up a virtual address, return the physical address,
 // or 0 if not mapped.
 // Can only be used to look up user pages.
@@ -110,29 +176,98 @@ walkaddr(pagetable_t pagetable, uint64 va)
 {
   pte_t *pte;
   uint64 pa;
+  int level;
 
   if(va >= MAXVA)
     return 0;
 
-  pte = walk(pagetable, va, 0);
+  pte = walkleaf(pagetable, va, &level);
   if(pte == 0)
     return 0;
   if((*pte & PTE_V) == 0)
     return 0;
   if((*pte & PTE_U) == 0)
     return 0;
-  pa = PTE2PA(*pte);
+  pa = leafpa(*pte, level, va);
   return pa;
 }
 
 // add a mapping to the kernel page table.
 // only used when booting.
 // does not flush TLB or enable paging.
+// va and pa must be page-aligned. Uses the largest pages
+// that va, pa and sz allow, to save PTEs and TLB entries.
 void
 kvmmap(pagetable_t kpgtbl, uint64 va, uint64 pa, uint64 sz, int perm)
 {
-  if(mappages(kpgtbl, va, sz, pa, perm) != 0)
-    panic("kvmmap");
+  uint64 a, end, size;
+  int level;
+  pte_t *pte;
+
+  if(va % PGSIZE != 0 || pa % PGSIZE != 0)
+    panic("kvmmap: align");
+
+  end = PGROUNDUP(va + sz);
+  for(a = va; a < end; a += size, pa += size){
+    for(level = 2; level > 0; level--){
+      size = LEVELSIZE(level);
+      if(a % size == 0 && pa % size == 0 && a + size <= end)
+        break;
+    }
+    size = LEVELSIZE(level);
+    if((pte = walklevel(kpgtbl, a, level, 1)) == 0)
+      panic("kvmmap");
+    if(*pte & PTE_V)
+      panic("kvmmap: remap");
+    *pte = PA2PTE(pa) | perm | PTE_V;
+    kvmleaves[level]++;
+  }
+}
+
+// Allocate a page for a kernel stack and map it at va in
+// the kernel page table. The page below va stays unmapped,
+// as a guard. Nothing has touched va since the flush that
+// followed its kvmunmapstack(), so no TLB can hold a stale
+// entry for it.
+// Returns 0, or -1 if out of memory.
+int
+kvmmapstack(uint64 va)
+{
+  char *pa;
+  pte_t *pte;
+
+  if((pa = kalloc()) == 0)
+    return -1;
+  acquire(&kvmlock);
+  if((pte = walk(kernel_pagetable, va, 1)) == 0){
+    release(&kvmlock);
+    kfree(pa);
+    return -1;
+  }
+  if(*pte & PTE_V)
+    panic("kvmmapstack: remap");
+  *pte = PA2PTE(pa) | PTE_R | PTE_W | PTE_V;
+  release(&kvmlock);
+  return 0;
+}
+
+// Unmap the kernel stack at va, and return its page's
+// physical address. The caller frees the page once every
+// CPU's TLB has been flushed (tlbshootdown(0)), which it
+// can do once for several stacks.
+uint64
+kvmunmapstack(uint64 va)
+{
+  uint64 pa;
+  pte_t *pte;
+
+  acquire(&kvmlock);
+  if((pte = walk(kernel_pagetable, va, 0)) == 0 || (*pte & PTE_V) == 0)
+    panic("kvmunmapstack");
+  pa = PTE2PA(*pte);
+  *pte = 0;
+  release(&kvmlock);
+  return pa;
 }
 
 // Create PTEs for virtual addresses starting at va that refer to
@@ -164,30 +299,65 @@ mappages(pagetable_t pagetable, uint64 va, uint64 size, uint64 pa, int perm)
   return 0;
 }
 
+#define UNMAPBATCH 32
+
 // Remove npages of mappings starting from va. va must be
-// page-aligned. The mappings must exist.
-// Optionally free the physical memory.
+// page-aligned. Pages that were never faulted in are skipped.
+// Optionally (do_free 1) free the physical memory. do_free 2
+// is for a page table that threads may be using on other CPUs:
+// each page is freed only after tlbshootdown(), so that no
+// stale TLB entry can reach it once it is reused.
 void
 uvmunmap(pagetable_t pagetable, uint64 va, uint64 npages, int do_free)
 {
-  uint64 a;
+  uint64 a, end, size, pas[UNMAPBATCH];
+  int orders[UNMAPBATCH];
   pte_t *pte;
+  int level, n = 0;
 
   if((va % PGSIZE) != 0)
     panic("uvmunmap: not aligned");
 
-  for(a = va; a < va + npages*PGSIZE; a += PGSIZE){
-    if((pte = walk(pagetable, a, 0)) == 0)
-      panic("uvmunmap: walk");
+  end = va + npages*PGSIZE;
+  for(a = va; a < end; a += size){
+    size = PGSIZE;
+    if((pte = walkleaf(pagetable, a, &level)) == 0){
+      // skip the rest of a range without page-table pages.
+      size = LEVELSIZE(level) - (a & (LEVELSIZE(level) - 1));
+      continue;
+    }
     if((*pte & PTE_V) == 0)
-      panic("uvmunmap: not mapped");
+      continue;
     if(PTE_FLAGS(*pte) == PTE_V)
       panic("uvmunmap: not a leaf");
-    if(do_free){
+    if(level > 0){
+      // callers split megapages that lie only partly in range.
+      size = LEVELSIZE(level);
+      if(a % size != 0 || a + size > end)
+        panic("uvmunmap: partial megapage");
+    }
+    if(do_free == 1){
       uint64 pa = PTE2PA(*pte);
-      kfree((void*)pa);
+      kfree_order((void*)pa, LEVELORDER(level));
+    } else if(do_free == 2){
+      orders[n] = LEVELORDER(level);
+      pas[n++] = PTE2PA(*pte);
     }
     *pte = 0;
+    if(n == UNMAPBATCH){
+      tlbshootdown(pagetable);
+      while(n > 0){
+        n--;
+        kfree_order((void*)pas[n], orders[n]);
+      }
+    }
+  }
+  if(n > 0){
+    tlbshootdown(pagetable);
+    while(n > 0){
+      n--;
+      kfree_order((void*)pas[n], orders[n]);
+    }
   }
 }
 
@@ -197,10 +367,9 @@ pagetable_t
 uvmcreate()
 {
   pagetable_t pagetable;
-  pagetable = (pagetable_t) kalloc();
+  pagetable = (pagetable_t) kalloc_zeroed();
   if(pagetable == 0)
     return 0;
-  memset(pagetable, 0, PGSIZE);
   return pagetable;
 }
 
@@ -214,8 +383,7 @@ uvmfirst(pagetable_t pagetable, uchar *src, uint sz)
 
   if(sz >= PGSIZE)
     panic("uvmfirst: more than a page");
-  mem = kalloc();
-  memset(mem, 0, PGSIZE);
+  mem = kalloc_zeroed();
   mappages(pagetable, 0, PGSIZE, (uint64)mem, PTE_W|PTE_R|PTE_X|PTE_U);
   memmove(mem, src, sz);
 }
@@ -233,15 +401,14 @@ uvmalloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz, int xperm)
 
   oldsz = PGROUNDUP(oldsz);
   for(a = oldsz; a < newsz; a += PGSIZE){
-    mem = kalloc();
+    mem = kalloc_zeroed();
     if(mem == 0){
-      uvmdealloc(pagetable, a, oldsz);
+      uvmdealloc(pagetable, a, oldsz, 1);
       return 0;
     }
-    memset(mem, 0, PGSIZE);
     if(mappages(pagetable, a, PGSIZE, (uint64)mem, PTE_R|PTE_U|xperm) != 0){
       kfree(mem);
-      uvmdealloc(pagetable, a, oldsz);
+      uvmdealloc(pagetable, a, oldsz, 1);
       return 0;
     }
   }
@@ -251,16 +418,22 @@ uvmalloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz, int xperm)
 // Deallocate user pages to bring the process size from oldsz to
 // newsz.  oldsz and newsz need not be page-aligned, nor does newsz
 // need to be less than oldsz.  oldsz can be larger than the actual
-// process size.  Returns the new process size.
+// process size.  do_free is as for uvmunmap().  Returns the new
+// process size, or oldsz if a megapage that newsz cuts in two
+// couldn't be split.
 uint64
-uvmdealloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz)
+uvmdealloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz, int do_free)
 {
   if(newsz >= oldsz)
     return oldsz;
 
+  // a megapage that straddles newsz keeps only its first part.
+  if(PGROUNDUP(newsz) % MEGAPGSIZE != 0 && uvmsplit(pagetable, PGROUNDUP(newsz)) != 0)
+    return oldsz;
+
   if(PGROUNDUP(newsz) < PGROUNDUP(oldsz)){
     int npages = (PGROUNDUP(oldsz) - PGROUNDUP(newsz)) / PGSIZE;
-    uvmunmap(pagetable, PGROUNDUP(newsz), npages, 1);
+    uvmunmap(pagetable, PGROUNDUP(newsz), npages, do_free);
   }
 
   return newsz;
@@ -298,40 +471,301 @@ uvmfree(pagetable_t pagetable, uint64 sz)
 
 // Given a parent process's page table, copy
 // its memory into a child's page table.
-// Copies both the page table and the
-// physical memory.
+// Copies only the page table: both processes
+// share the physical pages, and writable pages
+// become read-only copy-on-write pages in both,
+// to be copied by uvmcow() on the first store.
 // returns 0 on success, -1 on failure.
 // frees any allocated pages on failure.
 int
 uvmcopy(pagetable_t old, pagetable_t new, uint64 sz)
 {
-  pte_t *pte;
-  uint64 pa, i;
-  uint flags;
-  char *mem;
+  return uvmshare(old, new, 0, sz, 0);
+}
 
-  for(i = 0; i < sz; i += PGSIZE){
-    if((pte = walk(old, i, 0)) == 0)
-      panic("uvmcopy: pte should exist");
+// Make new map the same pages as old for the page-aligned
+// range [start, end). Unless shared, writable pages become
+// copy-on-write, as in uvmcopy(); shared pages stay writable
+// in both, so that each sees the other's stores.
+// returns 0 on success, -1 on failure.
+// unmaps anything it mapped on failure.
+int
+uvmshare(pagetable_t old, pagetable_t new, uint64 start, uint64 end, int shared)
+{
+  pte_t *pte, *npte;
+  uint64 pa, i, size;
+  int level;
+
+  for(i = start; i < end; i += size){
+    size = PGSIZE;
+    if((pte = walkleaf(old, i, &level)) == 0){
+      // skip the rest of a range without page-table pages.
+      size = LEVELSIZE(level) - (i & (LEVELSIZE(level) - 1));
+      continue;
+    }
     if((*pte & PTE_V) == 0)
-      panic("uvmcopy: page not present");
+      continue;  // not yet faulted in; the child will fault it in too.
+    if(level > 0){
+      // a megapage lies wholly in the heap; copy its one PTE.
+      size = LEVELSIZE(level);
+      if(i % size != 0 || i + size > end)
+        panic("uvmshare: partial megapage");
+    }
+    if(!shared && (*pte & PTE_W))
+      *pte = (*pte & ~PTE_W) | PTE_COW;
     pa = PTE2PA(*pte);
-    flags = PTE_FLAGS(*pte);
-    if((mem = kalloc()) == 0)
+    if((npte = walklevel(new, i, level, 1)) == 0)
       goto err;
-    memmove(mem, (char*)pa, PGSIZE);
-    if(mappages(new, i, PGSIZE, (uint64)mem, flags) != 0){
-      kfree(mem);
-      goto err;
-    }
+    if(*npte & PTE_V)
+      panic("uvmshare: remap");
+    *npte = *pte;
+    kdup_order((void*)pa, LEVELORDER(level));
   }
   return 0;
 
  err:
-  uvmunmap(new, 0, i / PGSIZE, 1);
+  uvmunmap(new, start, (i - start) / PGSIZE, 1);
   return -1;
 }
 
+// Split the user megapage that maps va, if there is one,
+// into 4096-byte PTEs that map the same memory, so that
+// part of it can be unmapped or copied. The huge page
+// becomes 512 pages with a reference count each, which page
+// tables still mapping it as a megapage drop one by one.
+// Returns 0 on success, -1 if out of memory.
+int
+uvmsplit(pagetable_t pagetable, uint64 va)
+{
+  pte_t *pte;
+  pagetable_t pt;
+  uint64 pa;
+  int level;
+
+  if(va >= MAXVA)
+    return 0;
+  pte = walkleaf(pagetable, va, &level);
+  if(pte == 0 || level == 0)
+    return 0;
+  if(level != 1)
+    panic("uvmsplit");
+
+  if((pt = (pagetable_t)kalloc()) == 0)
+    return -1;
+  pa = PTE2PA(*pte);
+  ksplit((void*)pa, MEGAORDER);
+  __sync_fetch_and_add(&nsplit, 1);
+  for(int i = 0; i < 512; i++)
+    pt[i] = PA2PTE(pa + i*PGSIZE) | PTE_FLAGS(*pte);
+  *pte = PA2PTE(pt) | PTE_V;
+  return 0;
+}
+
+// Resolve a store to the copy-on-write page at va by giving
+// pagetable its own writable copy of the page, or, if no
+// other page table still shares the page, by just making it
+// writable again. A shared megapage is copied to a new huge
+// page, or, if there is none, split so that only va's page
+// needs copying. Caller must hold the mm->lock of a page
+// table that threads share.
+// Returns 0 on success, -1 if va is not a copy-on-write
+// page or there is no memory for the copy.
+int
+uvmcow(pagetable_t pagetable, uint64 va)
+{
+  pte_t *pte;
+  uint64 pa;
+  uint flags;
+  char *mem;
+  int level;
+
+  if(va >= MAXVA)
+    return -1;
+  pte = walkleaf(pagetable, va, &level);
+  if(pte == 0 || (*pte & (PTE_V|PTE_U|PTE_COW)) != (PTE_V|PTE_U|PTE_COW))
+    return -1;
+  pa = PTE2PA(*pte);
+  flags = (PTE_FLAGS(*pte) & ~PTE_COW) | PTE_W;
+
+  if(krefcount((void*)pa, LEVELORDER(level)) == 1){
+    *pte = PA2PTE(pa) | flags;
+    return 0;
+  }
+
+  if(level > 0){
+    if((mem = kalloc_order(MEGAORDER)) == 0){
+      if(uvmsplit(pagetable, va) != 0)
+        return -1;
+      return uvmcow(pagetable, va);
+    }
+    memmove(mem, (char*)pa, MEGAPGSIZE);
+  } else {
+    if((mem = kalloc()) == 0)
+      return -1;
+    memmove(mem, (char*)pa, PGSIZE);
+  }
+  *pte = PA2PTE(mem) | flags;
+  // other threads' TLBs may still map the old page, which
+  // its other owner may free and reuse once we let go.
+  tlbshootdown(pagetable);
+  kfree_order((void*)pa, LEVELORDER(level));
+  return 0;
+}
+
+// Back the aligned 2 MiB block of the heap around va with a
+// zeroed megapage, if the whole block is heap that no page
+// has been faulted into yet, and a huge page is free.
+// Returns 0 on success, -1 if the caller should fault in
+// a 4096-byte page instead.
+static int
+uvmhugefault(struct proc *p, uint64 va)
+{
+  uint64 a;
+  pte_t *pte;
+  char *mem;
+
+  a = MEGAROUNDDOWN(va);
+  if(a + MEGAPGSIZE > p->mm->sz || vmaoverlap(p, a, a + MEGAPGSIZE))
+    return -1;
+  if((pte = walklevel(p->mm->pagetable, a, 1, 1)) == 0 || (*pte & PTE_V))
+    return -1;
+  if((mem = kalloc_order(MEGAORDER)) == 0)
+    return -1;
+  memset(mem, 0, MEGAPGSIZE);
+  *pte = PA2PTE(mem) | PTE_R | PTE_W | PTE_U | PTE_V;
+  __sync_fetch_and_add(&nhuge, 1);
+  return 0;
+}
+
+// Report how many user megapages heap faults have mapped,
+// and how many of those (or their copies) have been split.
+int
+vmstats(char *buf, int sz)
+{
+  return snprintf(buf, sz, "vm: %ld megapages mapped, %ld split\n", nhuge, nsplit);
+}
+
+// Handle a page fault at va in pagetable, which belongs to
+// the current process. A page of a program segment or of an
+// mmap()ed file is read in from the file; a page of the heap that sbrk() has
+// reserved but nobody has touched yet is allocated and zeroed,
+// a whole megapage at a time where possible;
+// a store to a copy-on-write page gets a private copy.
+// perm is the PTE bit the faulting access needs: PTE_R for
+// a load, PTE_W for a store, PTE_X for an instruction fetch.
+// fill is 0 if the caller holds locks and so can't wait for
+// a page to be read from a file; such a fault fails.
+// Another thread may have dealt with the fault already, in
+// which case this CPU's TLB is just out of date.
+// Returns 0 if the page is now mapped (or the access should
+// simply be tried again), or -1 if the access is illegal or
+// there is no memory.
+int
+vmfault(pagetable_t pagetable, uint64 va, int perm, int fill)
+{
+  struct proc *p = myproc();
+  struct mm *mm = 0;
+  struct vma *v;
+  pte_t *pte;
+  char *mem;
+  int r, write = perm == PTE_W;
+
+  if(va >= MAXVA)
+    return -1;
+  va = PGROUNDDOWN(va);
+
+  if(p && p->mm && pagetable == p->mm->pagetable){
+    mm = p->mm;
+    acquire(&mm->lock);
+  }
+
+  pte = walk(pagetable, va, 0);
+  if(pte && (*pte & PTE_V)){
+    // the page is present. only a store to a copy-on-write
+    // page or to a clean page of a shared mapping is allowed.
+    if((*pte & PTE_U) && (*pte & perm)){
+      sfence_vma();
+      r = 0;
+    } else if(write && (*pte & PTE_COW)){
+      r = uvmcow(pagetable, va);
+    } else if(write && mm && (v = vmalookup(p, va)) != 0){
+      r = vmafill(mm, v, va, write, fill);
+    } else {
+      r = -1;
+    }
+  } else if(mm == 0){
+    r = -1;
+  } else if((v = vmalookup(p, va)) != 0){
+    r = vmafill(mm, v, va, write, fill);
+  } else if(va >= mm->sz || perm == PTE_X){
+    // the heap and stack aren't executable.
+    r = -1;
+  } else if(uvmhugefault(p, va) == 0){
+    r = 0;
+  } else if((mem = kalloc_zeroed()) == 0){
+    r = -1;
+  } else if(mappages(pagetable, va, PGSIZE, (uint64)mem, PTE_R|PTE_W|PTE_U) != 0){
+    kfree(mem);
+    r = -1;
+  } else {
+    r = 0;
+  }
+
+  if(mm)
+    release(&mm->lock);
+  return r;
+}
+
+// Look up user virtual address va for a copy between kernel
+// and user memory, first resolving any page fault that a user
+// load (or, if write, a store) at va would take; fill is as
+// for vmfault().
+// Returns the physical address of the page, or 0 if the
+// access isn't allowed.
+uint64
+uvmtouch(pagetable_t pagetable, uint64 va, int write, int fill)
+{
+  pte_t *pte;
+  int level;
+
+  if(va >= MAXVA)
+    return 0;
+  // vmfault() may return 0 without having mapped the
+  // page, if it lost a race with another thread.
+  for(;;){
+    pte = walkleaf(pagetable, va, &level);
+    if(pte && (*pte & PTE_V) && (!write || (*pte & PTE_W)))
+      break;
+    if(vmfault(pagetable, va, write ? PTE_W : PTE_R, fill) != 0)
+      return 0;
+  }
+  if((*pte & PTE_U) == 0)
+    return 0;
+  return leafpa(*pte, level, va);
+}
+
+// Fault in the current process's file-backed pages in
+// [va, va+len) the way copyout() (if write) or copyin()
+// would, so that copyout_locked() or copyin_locked() can
+// copy them later. Other pages are left alone: those
+// copies can fault them in under any lock.
+// Stops quietly at the first page that can't be accessed.
+void
+uvmprefault(pagetable_t pagetable, uint64 va, uint64 len, int write)
+{
+  struct proc *p = myproc();
+  struct vma *v;
+  uint64 a;
+
+  for(a = PGROUNDDOWN(va); a < va + len; a += PGSIZE){
+    acquire(&p->mm->lock);
+    v = vmalookup(p, a);
+    release(&p->mm->lock);
+    if(v && uvmtouch(pagetable, a, write, 1) == 0)
+      break;
+  }
+}
+
 // mark a PTE invalid for user access.
 // used by exec for the user stack guard page.
 void
@@ -345,17 +779,14 @@ uvmclear(pagetable_t pagetable, uint64 va)
   *pte &= ~PTE_U;
 }
 
-// Copy from kernel to user.
-// Copy len bytes from src to virtual address dstva in a given page table.
-// Return 0 on success, -1 on error.
-int
-copyout(pagetable_t pagetable, uint64 dstva, char *src, uint64 len)
+static int
+copyto(pagetable_t pagetable, uint64 dstva, char *src, uint64 len, int fill)
 {
   uint64 n, va0, pa0;
 
   while(len > 0){
     va0 = PGROUNDDOWN(dstva);
-    pa0 = walkaddr(pagetable, va0);
+    pa0 = uvmtouch(pagetable, va0, 1, fill);
     if(pa0 == 0)
       return -1;
     n = PGSIZE - (dstva - va0);
@@ -370,17 +801,33 @@ copyout(pagetable_t pagetable, uint64 dstva, char *src, uint64 len)
   return 0;
 }
 
-// Copy from user to kernel.
-// Copy len bytes to dst from virtual address srcva in a given page table.
+// Copy from kernel to user.
+// Copy len bytes from src to virtual address dstva in a given page table.
+// Faults pages in (and copies copy-on-write pages) as a user store would.
 // Return 0 on success, -1 on error.
 int
-copyin(pagetable_t pagetable, char *dst, uint64 srcva, uint64 len)
+copyout(pagetable_t pagetable, uint64 dstva, char *src, uint64 len)
+{
+  return copyto(pagetable, dstva, src, len, 1);
+}
+
+// copyout() for a caller that holds locks, and so can't wait
+// for a page of an mmap()ed file to be read in; it should
+// uvmprefault() the destination first.
+int
+copyout_locked(pagetable_t pagetable, uint64 dstva, char *src, uint64 len)
+{
+  return copyto(pagetable, dstva, src, len, 0);
+}
+
+static int
+copyfrom(pagetable_t pagetable, char *dst, uint64 srcva, uint64 len, int fill)
 {
   uint64 n, va0, pa0;
 
   while(len > 0){
     va0 = PGROUNDDOWN(srcva);
-    pa0 = walkaddr(pagetable, va0);
+    pa0 = uvmtouch(pagetable, va0, 0, fill);
     if(pa0 == 0)
       return -1;
     n = PGSIZE - (srcva - va0);
@@ -395,6 +842,22 @@ copyin(pagetable_t pagetable, char *dst, uint64 srcva, uint64 len)
   return 0;
 }
 
+// Copy from user to kernel.
+// Copy len bytes to dst from virtual address srcva in a given page table.
+// Return 0 on success, -1 on error.
+int
+copyin(pagetable_t pagetable, char *dst, uint64 srcva, uint64 len)
+{
+  return copyfrom(pagetable, dst, srcva, len, 1);
+}
+
+// copyin() for a caller that holds locks; see copyout_locked().
+int
+copyin_locked(pagetable_t pagetable, char *dst, uint64 srcva, uint64 len)
+{
+  return copyfrom(pagetable, dst, srcva, len, 0);
+}
+
 // Copy a null-terminated string from user to kernel.
 // Copy bytes to dst from virtual address srcva in a given page table,
 // until a '\0', or max.
@@ -407,7 +870,7 @@ copyinstr(pagetable_t pagetable, char *dst, uint64 srcva, uint64 max)
 
   while(got_null == 0 && max > 0){
     va0 = PGROUNDDOWN(srcva);
-    pa0 = walkaddr(pagetable, va0);
+    pa0 = uvmtouch(pagetable, va0, 0, 1);
     if(pa0 == 0)
       return -1;
     n = PGSIZE - (srcva - va0);
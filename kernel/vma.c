@@ -0,0 +1,400 @@
+//
+// Memory regions (VMAs) of a user address space whose
+// pages are read in from an inode on first touch, rather
+// than when the region is set up. exec() describes each
+// program segment this way, and mmap() each mapped file;
+// vmfault() calls vmafill() to bring a page in.
+//
+// mmap() regions are placed top-down below the trapframes,
+// above the heap. A MAP_SHARED region's pages are mapped
+// without PTE_W until the first store, so PTE_W marks the
+// pages munmap() must write back to the file. Processes
+// share a MAP_SHARED region's pages only through fork().
+//
+// The regions are part of the struct mm that a process's
+// threads share, and mm->lock protects them.
+//
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "file.h"
+#include "fcntl.h"
+#include "defs.h"
+
+// Return the region of p that contains va, or 0.
+struct vma*
+vmalookup(struct proc *p, uint64 va)
+{
+  struct vma *v;
+
+  for(v = p->mm->vmas; v < &p->mm->vmas[NVMA]; v++){
+    if(v->ip && va >= v->start && va < v->end)
+      return v;
+  }
+  return 0;
+}
+
+// Fill in the page at va, which lies in region v of mm, by
+// reading it from v's inode, and map it. Bytes of the page
+// beyond the region's file data read as zero.
+// Caller must hold mm->lock, which is released while the
+// inode is read; if meanwhile another thread has filled the
+// page or unmapped the region, returns 0 without mapping
+// anything, so that the access is tried again.
+// If fill is 0 the caller can't sleep, and a page that would
+// have to be read fails.
+// Returns 0 on success, -1 if the access isn't allowed,
+// there is no memory, or the file couldn't be read.
+int
+vmafill(struct mm *mm, struct vma *v, uint64 va, int write, int fill)
+{
+  pagetable_t pagetable = mm->pagetable;
+  struct vma r;
+  uint64 off;
+  uint n;
+  char *mem;
+  int perm, ok;
+  pte_t *pte;
+
+  if(write && (v->perm & PTE_W) == 0)
+    return -1;
+
+  va = PGROUNDDOWN(va);
+  pte = walk(pagetable, va, 0);
+  if(pte && (*pte & PTE_V)){
+    // a store to a clean page of a shared mapping;
+    // from now on munmap() will write it back.
+    if(!write || (v->flags & MAP_SHARED) == 0)
+      return -1;
+    *pte |= PTE_W;
+    return 0;
+  }
+
+  if(!fill)
+    return -1;
+
+  if((mem = kalloc_zeroed()) == 0)
+    return -1;
+
+  // munmap() waits for mm->fills to drop to 0 before it
+  // lets go of the inode.
+  r = *v;
+  mm->fills++;
+  release(&mm->lock);
+  off = va - r.start;
+  ok = 1;
+  if(off < r.filesz){
+    n = r.filesz - off;
+    if(n > PGSIZE)
+      n = PGSIZE;
+    ilock(r.ip);
+    ok = readi(r.ip, 0, (uint64)mem, r.off + off, n) == n;
+    iunlock(r.ip);
+  }
+  acquire(&mm->lock);
+  if(--mm->fills == 0)
+    wakeup(&mm->fills);
+
+  // don't pass off a short read as file data.
+  if(!ok){
+    kfree(mem);
+    return -1;
+  }
+
+  pte = walk(pagetable, va, 0);
+  if(v->ip != r.ip || v->start != r.start || v->off != r.off || (pte && (*pte & PTE_V))){
+    kfree(mem);
+    return 0;
+  }
+
+  perm = r.perm;
+  if((r.flags & MAP_SHARED) && !write)
+    perm &= ~PTE_W;
+  if(mappages(pagetable, va, PGSIZE, (uint64)mem, perm) != 0){
+    kfree(mem);
+    return -1;
+  }
+  return 0;
+}
+
+// Copy the NVMA regions in src to dst, for fork().
+void
+vmadup(struct vma *dst, struct vma *src)
+{
+  for(int i = 0; i < NVMA; i++){
+    dst[i] = src[i];
+    if(dst[i].ip)
+      idup(dst[i].ip);
+  }
+}
+
+// Drop all NVMA regions in vmas and the inode references
+// they hold. The pages stay mapped; freeing them is up to
+// the caller. Must be called inside a transaction, since
+// it calls iput().
+void
+vmaclear(struct vma *vmas)
+{
+  struct vma *v;
+
+  for(v = vmas; v < &vmas[NVMA]; v++){
+    if(v->ip){
+      iput(v->ip);
+      v->ip = 0;
+    }
+  }
+}
+
+// Does [start, end) overlap any of p's regions?
+int
+vmaoverlap(struct proc *p, uint64 start, uint64 end)
+{
+  struct vma *v;
+
+  for(v = p->mm->vmas; v < &p->mm->vmas[NVMA]; v++){
+    if(v->ip && start < v->end && end > v->start)
+      return 1;
+  }
+  return 0;
+}
+
+// Give new the pages old has faulted in for the mmap()
+// regions in vmas, for fork(). Private regions become
+// copy-on-write; shared ones stay shared.
+// Returns 0 on success, -1 on failure, in which case
+// nothing is left mapped in new's mmap() regions.
+int
+vmacopy(pagetable_t old, pagetable_t new, struct vma *vmas)
+{
+  struct vma *v, *u;
+
+  for(v = vmas; v < &vmas[NVMA]; v++){
+    if(v->ip == 0 || v->flags == 0)
+      continue;
+    if(uvmshare(old, new, v->start, v->end, v->flags & MAP_SHARED) < 0)
+      goto err;
+  }
+  return 0;
+
+ err:
+  for(u = vmas; u < v; u++){
+    if(u->ip && u->flags)
+      uvmunmap(new, u->start, (u->end - u->start) / PGSIZE, 1);
+  }
+  return -1;
+}
+
+// Write the dirty pages of shared region v in [start, end)
+// back to its file, a few blocks per transaction, as
+// filewrite() does.
+// Returns 0, or -1 if a write to the file fell short.
+static int
+vmawriteback(pagetable_t pagetable, struct vma *v, uint64 start, uint64 end)
+{
+  int max = ((MAXOPBLOCKS-1-1-2) / 2) * BSIZE;
+  uint64 a, off;
+  uint n, i, n1;
+  pte_t *pte;
+  int r;
+
+  if((v->flags & MAP_SHARED) == 0)
+    return 0;
+  for(a = start; a < end; a += PGSIZE){
+    off = a - v->start;
+    if(off >= v->filesz)
+      break;
+    if((pte = walk(pagetable, a, 0)) == 0)
+      continue;
+    if((*pte & PTE_V) == 0 || (*pte & PTE_W) == 0)
+      continue;
+    n = v->filesz - off;
+    if(n > PGSIZE)
+      n = PGSIZE;
+    for(i = 0; i < n; i += n1){
+      n1 = n - i;
+      if(n1 > max)
+        n1 = max;
+      begin_op();
+      ilock(v->ip);
+      r = writei(v->ip, 0, PTE2PA(*pte) + i, v->off + off + i, n1);
+      iunlock(v->ip);
+      end_op();
+      if(r != n1)
+        return -1;
+    }
+  }
+  return 0;
+}
+
+// Map len bytes of f, starting at page-aligned offset off,
+// into the current process with protection prot (PROT_*)
+// and flags MAP_SHARED or MAP_PRIVATE. Nothing is read
+// until the pages are touched.
+// Returns the address of the region, or -1.
+uint64
+mmap(struct file *f, uint64 len, int prot, int flags, uint off)
+{
+  struct proc *p = myproc();
+  struct mm *mm = p->mm;
+  struct vma *v, *free;
+  uint64 start, end;
+  uint size;
+  int perm;
+
+  if(f->type != FD_INODE || !f->readable)
+    return -1;
+  if(flags != MAP_SHARED && flags != MAP_PRIVATE)
+    return -1;
+  if((flags & MAP_SHARED) && (prot & PROT_WRITE) && !f->writable)
+    return -1;
+  if(len == 0 || len > USERTOP || off % PGSIZE != 0)
+    return -1;
+  if((prot & (PROT_READ|PROT_WRITE|PROT_EXEC)) == 0)
+    return -1;
+
+  perm = PTE_U;
+  if(prot & PROT_READ)
+    perm |= PTE_R;
+  if(prot & PROT_WRITE)
+    perm |= PTE_R | PTE_W;
+  if(prot & PROT_EXEC)
+    perm |= PTE_X;
+
+  ilock(f->ip);
+  size = f->ip->size;
+  iunlock(f->ip);
+
+  acquire(&mm->lock);
+  free = 0;
+  for(v = mm->vmas; v < &mm->vmas[NVMA]; v++){
+    if(v->ip == 0){
+      free = v;
+      break;
+    }
+  }
+  if(free == 0)
+    goto bad;
+
+  // find the highest gap below the trapframes that fits.
+  len = PGROUNDUP(len);
+  end = USERTOP;
+  for(;;){
+    if(end < len || end - len < PGROUNDUP(mm->sz))
+      goto bad;
+    start = end - len;
+    for(v = mm->vmas; v < &mm->vmas[NVMA]; v++){
+      if(v->ip && v->flags && start < v->end && end > v->start)
+        break;
+    }
+    if(v == &mm->vmas[NVMA])
+      break;
+    end = v->start;
+  }
+
+  v = free;
+  v->start = start;
+  v->end = end;
+  v->perm = perm;
+  v->ip = idup(f->ip);
+  v->off = off;
+  v->filesz = 0;
+  if(off < size)
+    v->filesz = size - off < len ? size - off : len;
+  v->flags = flags;
+  release(&mm->lock);
+  return start;
+
+ bad:
+  release(&mm->lock);
+  return -1;
+}
+
+// Unmap [addr, addr+len) from the current process, writing
+// dirty shared pages back first. The range must lie within
+// one mmap() region, and must include its start or its end;
+// punching a hole in the middle isn't supported.
+// Returns 0 on success, -1 on failure, including a failed
+// write back, which leaves the range mapped.
+int
+munmap(uint64 addr, uint64 len)
+{
+  struct proc *p = myproc();
+  struct mm *mm = p->mm;
+  struct vma *v, r;
+  uint64 end;
+  int whole;
+
+  if(addr % PGSIZE != 0 || len == 0 || len > USERTOP || addr + len < addr)
+    return -1;
+  end = PGROUNDUP(addr + len);
+  acquire(&mm->lock);
+  if((v = vmalookup(p, addr)) == 0 || v->flags == 0 || end > v->end ||
+     (addr != v->start && end != v->end)){
+    release(&mm->lock);
+    return -1;
+  }
+  r = *v;
+  release(&mm->lock);
+
+  // writing back sleeps, so is done without mm->lock.
+  if(vmawriteback(mm->pagetable, &r, addr, end) < 0)
+    return -1;
+
+  acquire(&mm->lock);
+  if(v->ip != r.ip || v->start != r.start || v->end != r.end){
+    // another thread changed the region meanwhile.
+    release(&mm->lock);
+    return -1;
+  }
+  whole = addr == v->start && end == v->end;
+  if(whole){
+    v->ip = 0;
+  } else if(addr == v->start){
+    v->filesz = v->filesz > end - addr ? v->filesz - (end - addr) : 0;
+    v->off += end - addr;
+    v->start = end;
+  } else {
+    if(v->filesz > addr - v->start)
+      v->filesz = addr - v->start;
+    v->end = addr;
+  }
+  // wait out any vmafill() of the old region, so that it
+  // sees the change and maps nothing.
+  while(mm->fills > 0)
+    sleep(&mm->fills, &mm->lock);
+  uvmunmap(mm->pagetable, addr, (end - addr) / PGSIZE, mm->users > 1 ? 2 : 1);
+  release(&mm->lock);
+
+  if(whole){
+    begin_op();
+    iput(r.ip);
+    end_op();
+  }
+  return 0;
+}
+
+// Unmap all of p's mmap() regions, for exit() by the last
+// thread of p's address space, and exec().
+void
+munmapall(struct proc *p)
+{
+  struct mm *mm = p->mm;
+  struct vma *v;
+
+  for(v = mm->vmas; v < &mm->vmas[NVMA]; v++){
+    if(v->ip == 0 || v->flags == 0)
+      continue;
+    vmawriteback(mm->pagetable, v, v->start, v->end);
+    uvmunmap(mm->pagetable, v->start, (v->end - v->start) / PGSIZE, 1);
+    begin_op();
+    iput(v->ip);
+    end_op();
+    v->ip = 0;
+  }
+}
@@ -0,0 +1,104 @@
+// Check how evenly competing CPU-bound processes share
+// the CPUs: fork spinners that count loops until a common
+// deadline, then compare their counts.
+//
+// usage: cfstest [nspin [ticks]]
+//
+// Each CPU shares out only its own run queue, so expect
+// an even split only if nspin is a multiple of the number
+// of CPUs (3 by default; see CPUS in the Makefile).
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "user/user.h"
+
+#define NSPIN  6    // default number of spinners
+#define TICKS  100  // default length of the race
+#define SLACK  20   // allowed difference from the mean, in percent
+#define MAXSPIN 32
+
+void
+spin(int fd, int start, int end)
+{
+  volatile int j;
+  uint64 n = 0;
+
+  // spin, rather than sleep, until the start, so that no one
+  // gets ahead by waking up first.
+  while(uptime() < start)
+    ;
+  while(uptime() < end){
+    for(j = 0; j < 1000; j++)
+      ;
+    n++;
+  }
+  write(fd, &n, sizeof(n));
+  exit(0);
+}
+
+int
+main(int argc, char *argv[])
+{
+  int nspin = NSPIN, ticks = TICKS;
+  int fds[2], i, start, bad;
+  uint64 counts[MAXSPIN], total, mean, diff;
+
+  if(argc > 1)
+    nspin = atoi(argv[1]);
+  if(argc > 2)
+    ticks = atoi(argv[2]);
+  if(nspin < 1 || nspin > MAXSPIN || ticks < 1){
+    fprintf(2, "usage: cfstest [nspin [ticks]]\n");
+    exit(1);
+  }
+
+  if(pipe(fds) < 0){
+    fprintf(2, "cfstest: pipe failed\n");
+    exit(1);
+  }
+  start = uptime() + 2;
+  for(i = 0; i < nspin; i++){
+    int pid = fork();
+    if(pid < 0){
+      fprintf(2, "cfstest: fork failed\n");
+      exit(1);
+    }
+    if(pid == 0){
+      close(fds[0]);
+      spin(fds[1], start, start + ticks);
+    }
+  }
+  close(fds[1]);
+
+  total = 0;
+  for(i = 0; i < nspin; i++){
+    if(read(fds[0], &counts[i], sizeof(counts[i])) != sizeof(counts[i])){
+      fprintf(2, "cfstest: short read\n");
+      exit(1);
+    }
+    total += counts[i];
+  }
+  for(i = 0; i < nspin; i++)
+    wait(0);
+  if(total == 0){
+    fprintf(2, "cfstest: no progress\n");
+    exit(1);
+  }
+
+  mean = total / nspin;
+  bad = 0;
+  for(i = 0; i < nspin; i++){
+    diff = counts[i] > mean ? counts[i] - mean : mean - counts[i];
+    printf("spinner %d: %ld loops, %ld%% of the work\n", i, counts[i],
+           counts[i] * 100 / total);
+    if(diff * 100 > mean * SLACK)
+      bad++;
+  }
+  if(bad){
+    printf("cfstest: %d of %d spinners more than %d%% from the mean\n",
+           bad, nspin, SLACK);
+    exit(1);
+  }
+  printf("cfstest: OK\n");
+  exit(0);
+}
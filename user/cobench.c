@@ -0,0 +1,216 @@
+// Compare the cost of switching between coroutines (coro.c)
+// with switching between processes: for a fixed time each,
+// count
+//
+//   yield   two coroutines handing over with co_yield()
+//   copipe  two coroutines ping-ponging a byte through
+//           O_NONBLOCK pipes with co_read()/co_write()
+//   fork    two processes ping-ponging a byte through pipes
+//   many    NCORO coroutines yielding on several workers
+//
+// usage: cobench [ticks [nworker]]
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/fcntl.h"
+#include "kernel/param.h"
+#include "user/user.h"
+
+#define TICKS  (2*HZ)  // default length of each run
+#define NCORO  1000
+#define NYIELD 100
+
+int ticks = TICKS;
+int end;
+int stop;
+uint64 count;
+
+// the number of nanoseconds each of n events took, on average,
+// in a run of t ticks.
+uint64
+each(uint64 n, int t)
+{
+  if(n == 0)
+    return 0;
+  return (uint64)t * (1000000000 / HZ) / n;
+}
+
+void
+ping(void *arg)
+{
+  int i;
+
+  while(uptime() < end){
+    for(i = 0; i < 256; i++)
+      co_yield();
+  }
+  stop = 1;
+}
+
+void
+pong(void *arg)
+{
+  while(!stop){
+    count++;
+    co_yield();
+  }
+}
+
+int fds1[2], fds2[2];
+
+void
+copinger(void *arg)
+{
+  char c = 0;
+  int i;
+
+  while(uptime() < end){
+    for(i = 0; i < 64; i++){
+      if(co_write(fds1[1], &c, 1) != 1 || co_read(fds2[0], &c, 1) != 1){
+        printf("cobench: copipe i/o failed\n");
+        exit(1);
+      }
+      count++;
+    }
+  }
+  close(fds1[1]);
+}
+
+void
+coponger(void *arg)
+{
+  char c;
+
+  while(co_read(fds1[0], &c, 1) == 1)
+    co_write(fds2[1], &c, 1);
+  close(fds2[1]);
+}
+
+void
+yielder(void *arg)
+{
+  for(int i = 0; i < NYIELD; i++){
+    __atomic_fetch_add(&count, 1, __ATOMIC_RELAXED);
+    co_yield();
+  }
+}
+
+int
+start(void)
+{
+  int t = uptime();
+
+  // begin at a tick boundary.
+  while(uptime() == t)
+    ;
+  return t + 1;
+}
+
+int
+main(int argc, char *argv[])
+{
+  int nworker = 2, i, t, pid;
+  char c = 0;
+
+  if(argc > 1)
+    ticks = atoi(argv[1]);
+  if(argc > 2)
+    nworker = atoi(argv[2]);
+  if(ticks < 1){
+    fprintf(2, "usage: cobench [ticks [nworker]]\n");
+    exit(1);
+  }
+
+  // coroutines yielding to each other, on one worker.
+  count = 0;
+  stop = 0;
+  t = start();
+  end = t + ticks;
+  co_spawn(ping, 0);
+  co_spawn(pong, 0);
+  co_run(1);
+  t = uptime() - t;
+  printf("yield: %l switches in %d ticks, %l ns each\n",
+         2*count, t, each(2*count, t));
+
+  // coroutines ping-ponging through pipes, on one worker.
+  if(pipe(fds1) < 0 || pipe(fds2) < 0){
+    printf("cobench: pipe failed\n");
+    exit(1);
+  }
+  for(i = 0; i < 2; i++){
+    fcntl(fds1[i], F_SETFL, O_NONBLOCK);
+    fcntl(fds2[i], F_SETFL, O_NONBLOCK);
+  }
+  count = 0;
+  t = start();
+  end = t + ticks;
+  co_spawn(copinger, 0);
+  co_spawn(coponger, 0);
+  co_run(1);
+  t = uptime() - t;
+  close(fds1[0]);
+  close(fds2[0]);
+  printf("copipe: %l round trips in %d ticks, %l ns each\n",
+         count, t, each(count, t));
+
+  // processes ping-ponging through pipes.
+  if(pipe(fds1) < 0 || pipe(fds2) < 0){
+    printf("cobench: pipe failed\n");
+    exit(1);
+  }
+  pid = fork();
+  if(pid < 0){
+    printf("cobench: fork failed\n");
+    exit(1);
+  }
+  if(pid == 0){
+    close(fds1[1]);
+    close(fds2[0]);
+    while(read(fds1[0], &c, 1) == 1)
+      write(fds2[1], &c, 1);
+    exit(0);
+  }
+  close(fds1[0]);
+  close(fds2[1]);
+  count = 0;
+  t = start();
+  end = t + ticks;
+  while(uptime() < end){
+    for(i = 0; i < 64; i++){
+      if(write(fds1[1], &c, 1) != 1 || read(fds2[0], &c, 1) != 1){
+        printf("cobench: fork i/o failed\n");
+        exit(1);
+      }
+      count++;
+    }
+  }
+  t = uptime() - t;
+  close(fds1[1]);
+  close(fds2[0]);
+  wait(0);
+  printf("fork: %l round trips in %d ticks, %l ns each\n",
+         count, t, each(count, t));
+
+  // many coroutines, M:N on nworker threads.
+  count = 0;
+  t = uptime();
+  for(i = 0; i < NCORO; i++){
+    if(co_spawn(yielder, 0) < 0){
+      printf("cobench: co_spawn failed\n");
+      exit(1);
+    }
+  }
+  if(co_run(nworker) < 0){
+    printf("cobench: co_run failed\n");
+    exit(1);
+  }
+  t = uptime() - t;
+  if(count != NCORO*NYIELD){
+    printf("cobench: many: count %l, not %d\n", count, NCORO*NYIELD);
+    exit(1);
+  }
+  printf("many: %d coroutines on %d workers, %l yields in %d ticks\n",
+         NCORO, nworker, count, t);
+  exit(0);
+}
@@ -0,0 +1,343 @@
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/fcntl.h"
+#include "kernel/param.h"
+#include "user/user.h"
+
+//
+// Coroutines: cheap, cooperatively scheduled tasks, run
+// M:N on a few kernel threads (workers).
+//
+// Each coroutine has its own small stack, and runs until it
+// returns, calls co_yield(), or has to wait in co_read() or
+// co_write(). It then switches (coswtch.S) back to its
+// worker's scheduler loop, which picks the next coroutine
+// off a run queue that all the workers share.
+//
+// co_read() and co_write() are meant for descriptors made
+// O_NONBLOCK with fcntl(). When the I/O would wait, only the
+// coroutine is parked; once every runnable coroutine is
+// waiting, one worker poll()s the parked descriptors and
+// puts those that are ready back on the run queue. Any other
+// system call that waits holds up the whole worker.
+//
+// Each worker keeps its struct worker in the tp register,
+// which nothing else in user space uses.
+//
+
+#define COSTACK  4096  // bytes of stack per coroutine
+#define NWORKER  8
+
+// callee-saved registers, as coswtch.S saves them.
+struct coctx {
+  uint64 ra;
+  uint64 sp;
+  uint64 s[12];
+};
+
+enum costate { CO_RUNNABLE, CO_PARKED, CO_DONE };
+
+struct coro {
+  struct coctx ctx;
+  struct coro *next;      // on the run queue or the parked list
+  void (*fn)(void*);
+  void *arg;
+  char *stack;
+  enum costate state;     // what its worker does after switching away
+  struct pollfd pfd;      // what a parked coroutine waits for
+};
+
+struct worker {
+  struct coctx ctx;       // the scheduler loop's
+  struct coro *cur;       // coroutine running, or 0
+};
+
+void coswtch(struct coctx*, struct coctx*);
+
+static struct {
+  struct mutex lock;
+  struct cond cond;       // idle workers wait here for work
+  struct coro *head;      // run queue
+  struct coro *tail;
+  struct coro *parked;    // waiting for I/O
+  int live;               // coroutines that haven't returned
+  int polling;            // a worker is in poll()
+  int wakefd[2];          // written to, to interrupt that poll()
+} rt;
+
+static struct worker*
+self(void)
+{
+  struct worker *w;
+
+  asm volatile("mv %0, tp" : "=r" (w));
+  return w;
+}
+
+// Put c on the run queue. Caller must hold rt.lock.
+static void
+enqueue(struct coro *c)
+{
+  c->next = 0;
+  if(rt.tail)
+    rt.tail->next = c;
+  else
+    rt.head = c;
+  rt.tail = c;
+  cond_signal(&rt.cond);
+}
+
+// Switch from the current coroutine back to its worker,
+// which deals with it according to state.
+static void
+coswitch(enum costate state)
+{
+  struct coro *c = self()->cur;
+
+  c->state = state;
+  coswtch(&c->ctx, &self()->ctx);
+}
+
+// Where every coroutine starts.
+static void
+costart(void)
+{
+  struct coro *c = self()->cur;
+
+  c->fn(c->arg);
+  coswitch(CO_DONE);
+}
+
+// Create a coroutine that will run fn(arg).
+// Returns 0, or -1 if there is no memory.
+int
+co_spawn(void (*fn)(void*), void *arg)
+{
+  struct coro *c;
+
+  if((c = malloc(sizeof(*c))) == 0)
+    return -1;
+  if((c->stack = malloc(COSTACK)) == 0){
+    free(c);
+    return -1;
+  }
+  memset(&c->ctx, 0, sizeof(c->ctx));
+  c->ctx.ra = (uint64)costart;
+  c->ctx.sp = (uint64)(c->stack + COSTACK) & ~15L;
+  c->fn = fn;
+  c->arg = arg;
+  mutex_lock(&rt.lock);
+  rt.live++;
+  enqueue(c);
+  mutex_unlock(&rt.lock);
+  return 0;
+}
+
+// Let the other runnable coroutines run.
+void
+co_yield(void)
+{
+  coswitch(CO_RUNNABLE);
+}
+
+// Would I/O on fd wait for the given poll() event?
+// Returns 1 if so, 0 if fd is ready, or -1 if poll() fails.
+static int
+wouldwait(int fd, int events)
+{
+  struct pollfd p;
+  int r;
+
+  p.fd = fd;
+  p.events = events;
+  p.revents = 0;
+  if((r = poll(&p, 1, 0)) < 0)
+    return -1;
+  return r == 0;
+}
+
+// Park the current coroutine until fd is ready for events.
+static void
+copark(int fd, int events)
+{
+  struct coro *c = self()->cur;
+
+  c->pfd.fd = fd;
+  c->pfd.events = events;
+  c->pfd.revents = 0;
+  coswitch(CO_PARKED);
+}
+
+// read() for a coroutine: if fd is O_NONBLOCK and has no
+// data, wait for some without holding up the worker.
+// A failed read() of a descriptor that poll() then finds
+// ready may only have lost a race with a coroutine on
+// another worker, so is tried again; failing twice in a
+// row like that is a real error.
+int
+co_read(int fd, void *buf, int n)
+{
+  int r, w, again = 0;
+
+  for(;;){
+    if((r = read(fd, buf, n)) >= 0)
+      return r;
+    if((w = wouldwait(fd, POLLIN)) < 0 || (w == 0 && again))
+      return -1;
+    if(w)
+      copark(fd, POLLIN);
+    again = !w;
+  }
+}
+
+// write() for a coroutine, as co_read() is for read().
+int
+co_write(int fd, const void *buf, int n)
+{
+  int r, w, again = 0;
+
+  for(;;){
+    if((r = write(fd, buf, n)) >= 0)
+      return r;
+    if((w = wouldwait(fd, POLLOUT)) < 0 || (w == 0 && again))
+      return -1;
+    if(w)
+      copark(fd, POLLOUT);
+    again = !w;
+  }
+}
+
+// Interrupt a worker's poll(), which doesn't know about a
+// coroutine parked since it started.
+// Caller must hold rt.lock.
+static void
+kick(void)
+{
+  if(rt.polling)
+    write(rt.wakefd[1], "x", 1);
+}
+
+// Wait in poll() for a parked coroutine's descriptor to be
+// ready, and make those coroutines runnable.
+// Called and returns with rt.lock held.
+static void
+iopoll(void)
+{
+  struct pollfd fds[NOFILE];
+  struct coro *c, **pp;
+  char buf[16];
+  int i, n, r;
+
+  // one entry per descriptor, the first for wakefd.
+  fds[0].fd = rt.wakefd[0];
+  fds[0].events = POLLIN;
+  n = 1;
+  for(c = rt.parked; c; c = c->next){
+    for(i = 0; i < n && fds[i].fd != c->pfd.fd; i++)
+      ;
+    if(i == n){
+      if(n == NOFILE)
+        continue;
+      fds[n].fd = c->pfd.fd;
+      fds[n++].events = 0;
+    }
+    fds[i].events |= c->pfd.events;
+  }
+
+  rt.polling = 1;
+  mutex_unlock(&rt.lock);
+  r = poll(fds, n, -1);
+  if(r > 0 && fds[0].revents)
+    while(read(rt.wakefd[0], buf, sizeof(buf)) > 0)
+      ;
+  mutex_lock(&rt.lock);
+  rt.polling = 0;
+
+  // on error, e.g. a descriptor closed, let them all try
+  // again and see it for themselves.
+  for(pp = &rt.parked; (c = *pp) != 0; ){
+    for(i = 1; i < n && fds[i].fd != c->pfd.fd; i++)
+      ;
+    if(r < 0 || (i < n && (fds[i].revents & c->pfd.events))){
+      *pp = c->next;
+      enqueue(c);
+    } else {
+      pp = &c->next;
+    }
+  }
+}
+
+// A worker's scheduler loop: run coroutines until none
+// are left.
+static void
+schedule(void *arg)
+{
+  struct worker *w = arg;
+  struct coro *c;
+
+  asm volatile("mv tp, %0" : : "r" (w));
+  mutex_lock(&rt.lock);
+  for(;;){
+    if((c = rt.head) != 0){
+      if((rt.head = c->next) == 0)
+        rt.tail = 0;
+      mutex_unlock(&rt.lock);
+      w->cur = c;
+      coswtch(&w->ctx, &c->ctx);
+      w->cur = 0;
+      // c is off its stack now, so may run elsewhere.
+      mutex_lock(&rt.lock);
+      if(c->state == CO_RUNNABLE){
+        enqueue(c);
+      } else if(c->state == CO_PARKED){
+        c->next = rt.parked;
+        rt.parked = c;
+        kick();
+      } else {
+        free(c->stack);
+        free(c);
+        if(--rt.live == 0)
+          cond_broadcast(&rt.cond);
+      }
+    } else if(rt.live == 0){
+      break;
+    } else if(rt.parked && !rt.polling){
+      iopoll();
+    } else {
+      cond_wait(&rt.cond, &rt.lock);
+    }
+  }
+  mutex_unlock(&rt.lock);
+}
+
+// Run the coroutines spawned so far, and those they spawn,
+// on nworker kernel threads (the caller's included), until
+// all have returned.
+// Returns 0, or -1 if the workers couldn't be started.
+int
+co_run(int nworker)
+{
+  struct worker w[NWORKER];
+  struct thread t[NWORKER];
+  int i, n;
+
+  if(nworker < 1 || nworker > NWORKER)
+    return -1;
+  if(pipe(rt.wakefd) < 0)
+    return -1;
+  fcntl(rt.wakefd[0], F_SETFL, O_NONBLOCK);
+  fcntl(rt.wakefd[1], F_SETFL, O_NONBLOCK);
+
+  memset(w, 0, sizeof(w));
+  for(n = 1; n < nworker; n++){
+    if(thread_create(&t[n], schedule, &w[n]) < 0)
+      break;
+  }
+  schedule(&w[0]);
+  for(i = 1; i < n; i++)
+    thread_join(&t[i]);
+
+  close(rt.wakefd[0]);
+  close(rt.wakefd[1]);
+  return 0;
+}
@@ -0,0 +1,60 @@
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "user/user.h"
+
+//
+// Threads on clone() and join(). Each thread gets a stack
+// from malloc(), which thread_join() frees.
+//
+
+#define TSTACK 8192
+
+struct tstart {
+  void (*fn)(void*);
+  void *arg;
+};
+
+// Where each thread starts, on its new stack.
+static void
+tstart(void *a)
+{
+  struct tstart *s = a;
+
+  s->fn(s->arg);
+  texit(0);
+}
+
+// Start a thread that runs fn(arg), sharing the caller's
+// memory and open files, and fill in *t.
+// Returns 0, or -1 on failure.
+int
+thread_create(struct thread *t, void (*fn)(void*), void *arg)
+{
+  struct tstart *s;
+  char *stack;
+
+  if((stack = malloc(TSTACK)) == 0)
+    return -1;
+  // fn and arg go at the top of the stack, and the thread's
+  // sp starts just below them, 16-byte aligned.
+  s = (struct tstart*)((uint64)(stack + TSTACK - sizeof(*s)) & ~15L);
+  s->fn = fn;
+  s->arg = arg;
+  if((t->tid = clone(tstart, s, s)) < 0){
+    free(stack);
+    return -1;
+  }
+  t->stack = stack;
+  return 0;
+}
+
+// Wait for thread t to finish, and free its stack.
+// Returns 0, or -1 if t isn't a thread of this process.
+int
+thread_join(struct thread *t)
+{
+  if(join(t->tid, 0) < 0)
+    return -1;
+  free(t->stack);
+  return 0;
+}
@@ -1,4 +1,5 @@
 struct stat;
+struct pollfd;
 
 // system calls
 int fork(void);
@@ -22,8 +23,26 @@ int getpid(void);
 char* sbrk(int);
 int sleep(int);
 int uptime(void);
+void* mmap(void*, uint, int, int, int, uint);
+int munmap(void*, uint);
+int setpriority(int, int);
+int sched_deadline(int, int, int);
+int nanosleep(uint64);
+int futex_wait(int*, int, uint64);
+int futex_wake(int*, int);
+int clone(void(*)(void*), void*, void*);
+int join(int, int*);
+int texit(int) __attribute__((noreturn));
+int fcntl(int, int, int);
+int poll(struct pollfd*, int, int);
 
 // ulib.c
+struct mutex {
+  int state;  // 0 free, 1 held, 2 held and maybe waited for
+};
+struct cond {
+  int seq;    // bumped by each signal
+};
 int stat(const char*, struct stat*);
 char* strcpy(char*, const char*);
 void *memmove(void*, const void*, int);
@@ -39,3 +58,26 @@ void free(void*);
 int atoi(const char*);
 int memcmp(const void *, const void *, uint);
 void *memcpy(void *, const void *, uint);
+void mutex_init(struct mutex*);
+void mutex_lock(struct mutex*);
+int mutex_trylock(struct mutex*);
+void mutex_unlock(struct mutex*);
+void cond_init(struct cond*);
+void cond_wait(struct cond*, struct mutex*);
+void cond_signal(struct cond*);
+void cond_broadcast(struct cond*);
+
+// thread.c
+struct thread {
+  int tid;
+  void *stack;
+};
+int thread_create(struct thread*, void (*)(void*), void*);
+int thread_join(struct thread*);
+
+// coro.c, which isn't in ULIB; see cobench in the Makefile.
+int co_spawn(void (*)(void*), void*);
+void co_yield(void);
+int co_read(int, void*, int);
+int co_write(int, const void*, int);
+int co_run(int);
@@ -785,6 +785,50 @@ pipe1(char *s)
   }
 }
 
+// many readers and writers on one pipe, each moving one byte
+// at a time, so that every wakeup must reach the next waiter.
+void
+pipemany(char *s)
+{
+  int fds[2], pid, xstatus, i;
+  char c;
+  enum { N=8, M=200 };
+
+  if(pipe(fds) != 0){
+    printf("%s: pipe() failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < 2*N; i++){
+    pid = fork();
+    if(pid < 0){
+      printf("%s: fork() failed\n", s);
+      exit(1);
+    }
+    if(pid == 0){
+      c = 'x';
+      for(int j = 0; j < M; j++){
+        if(i < N){
+          if(read(fds[0], &c, 1) != 1)
+            exit(1);
+        } else if(write(fds[1], &c, 1) != 1){
+          exit(1);
+        }
+      }
+      exit(0);
+    }
+  }
+  close(fds[0]);
+  close(fds[1]);
+  for(i = 0; i < 2*N; i++){
+    wait(&xstatus);
+    if(xstatus != 0){
+      printf("%s: reader or writer failed\n", s);
+      exit(1);
+    }
+  }
+  exit(0);
+}
+
 
 // test if child is killed (status = -1)
 void
@@ -815,6 +859,120 @@ killstatus(char *s)
   exit(0);
 }
 
+// setpriority() accepts nice values in range, for the
+// caller or another process, and rejects the rest.
+void
+setprio(char *s)
+{
+  int pid, xst;
+
+  if(setpriority(0, 19) != 0 || setpriority(getpid(), -20) != 0){
+    printf("%s: setpriority on self failed\n", s);
+    exit(1);
+  }
+  if(setpriority(0, 20) != -1 || setpriority(0, -21) != -1){
+    printf("%s: setpriority accepted a bad nice value\n", s);
+    exit(1);
+  }
+  // every value in range is accepted, and (see baseprio()
+  // in kernel/sched.c) under MLFQ each positive one keeps
+  // the process off the top level.
+  for(int nice = -20; nice <= 19; nice++){
+    if(setpriority(0, nice) != 0){
+      printf("%s: setpriority(0, %d) failed\n", s, nice);
+      exit(1);
+    }
+  }
+  setpriority(0, 0);
+  if(setpriority(-1, 0) != -1){
+    printf("%s: setpriority accepted a bad pid\n", s);
+    exit(1);
+  }
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    for(;;)
+      getpid();
+  }
+  if(setpriority(pid, 19) != 0){
+    printf("%s: setpriority on child failed\n", s);
+    exit(1);
+  }
+  kill(pid);
+  wait(&xst);
+  exit(0);
+}
+
+// a process can become real-time with sensible parameters,
+// run on its budget, and go back to being ordinary.
+void
+edf(char *s)
+{
+  int t;
+
+  if(sched_deadline(2, 10, 1) != -1 || sched_deadline(1, 5, 10) != -1 ||
+     sched_deadline(-1, 10, 10) != -1){
+    printf("%s: sched_deadline accepted bad parameters\n", s);
+    exit(1);
+  }
+  if(sched_deadline(1, 4, 4) != 0){
+    printf("%s: sched_deadline failed\n", s);
+    exit(1);
+  }
+  // spin through a few periods, being throttled in each.
+  t = uptime();
+  while(uptime() < t + 10)
+    ;
+  if(sched_deadline(0, 0, 0) != 0){
+    printf("%s: leaving real-time failed\n", s);
+    exit(1);
+  }
+  exit(0);
+}
+
+void
+nanosleeptest(char *s)
+{
+  int pid, xstatus, t;
+
+  // 50 sleeps of 1ms take 50ms or so; allow half a second,
+  // plus a tick for the uptime() rounding.
+  t = uptime();
+  for(int i = 0; i < 50; i++){
+    if(nanosleep(1000000) != 0){
+      printf("%s: nanosleep failed\n", s);
+      exit(1);
+    }
+  }
+  t = uptime() - t;
+  if(t > HZ/2 + 1){
+    printf("%s: 50 sleeps of 1ms took %d ticks\n", s, t);
+    exit(1);
+  }
+
+  // a long sleep must end early when the sleeper is killed.
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    nanosleep(10000000000UL);
+    exit(0);
+  }
+  sleep(1);
+  kill(pid);
+  wait(&xstatus);
+  if(xstatus != -1){
+    printf("%s: killed sleeper exited %d\n", s, xstatus);
+    exit(1);
+  }
+  exit(0);
+}
+
 // meant to be run w/ at most two CPUs
 void
 preempt(char *s)
@@ -1953,6 +2111,48 @@ iref(char *s)
   chdir("/");
 }
 
+// hold more open files, all told, than the kernel once had
+// room for in its fixed file table.
+void
+manyfds(char *s)
+{
+  enum { NCHILD=12 };
+  int i, j, pid, xstatus, fds[2];
+  char c;
+
+  if(pipe(fds) < 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < NCHILD; i++){
+    pid = fork();
+    if(pid < 0){
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if(pid == 0){
+      close(fds[1]);
+      for(j = 0; j < NOFILE - 4; j++){
+        if(open("README", O_RDONLY) < 0){
+          printf("%s: open #%d failed\n", s, j);
+          exit(1);
+        }
+      }
+      // hold them until the parent closes the pipe.
+      read(fds[0], &c, 1);
+      exit(0);
+    }
+  }
+  close(fds[0]);
+  sleep(5);
+  close(fds[1]);
+  for(i = 0; i < NCHILD; i++){
+    wait(&xstatus);
+    if(xstatus != 0)
+      exit(1);
+  }
+}
+
 // test that fork fails gracefully
 // the forktest binary also does this, but it runs out of proc entries first.
 // inside the bigger usertests binary, we run out of memory first.
@@ -1993,6 +2193,91 @@ forktest(char *s)
   }
 }
 
+// more processes than the old fixed table of 64 can exist
+// at once, and their kernel stacks come and go with them.
+void
+manyprocs(char *s)
+{
+  enum { N = 100 };
+  int fds[2], n, pid;
+  char c;
+
+  if(pipe(fds) < 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  for(n = 0; n < N; n++){
+    pid = fork();
+    if(pid < 0){
+      printf("%s: fork %d failed\n", s, n);
+      exit(1);
+    }
+    if(pid == 0){
+      close(fds[1]);
+      read(fds[0], &c, 1);
+      exit(0);
+    }
+  }
+  close(fds[0]);
+  close(fds[1]);
+  for(; n > 0; n--){
+    if(wait(0) < 0){
+      printf("%s: wait stopped early\n", s);
+      exit(1);
+    }
+  }
+}
+
+// does fork share memory copy-on-write? a process using
+// more than half of physical memory can fork only if its
+// pages aren't copied, and each side must still see only
+// its own stores.
+void
+cowfork(char *s)
+{
+  enum { BIG=64*1024*1024 };
+  char *a, *p;
+  int pid, xstatus;
+
+  a = sbrk(BIG);
+  if(a == (char*)0xffffffffffffffffL){
+    printf("%s: sbrk(%d) failed\n", s, BIG);
+    exit(1);
+  }
+  for(p = a; p < a + BIG; p += PGSIZE)
+    *(int*)p = 1;
+
+  for(int i = 0; i < 3; i++){
+    pid = fork();
+    if(pid < 0){
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if(pid == 0){
+      for(p = a; p < a + BIG; p += PGSIZE){
+        if(*(int*)p != 1){
+          printf("%s: child saw %d, not 1\n", s, *(int*)p);
+          exit(1);
+        }
+      }
+      for(p = a; p < a + BIG; p += 64*PGSIZE)
+        *(int*)p = 2;
+      exit(0);
+    }
+    wait(&xstatus);
+    if(xstatus != 0)
+      exit(1);
+    for(p = a; p < a + BIG; p += PGSIZE){
+      if(*(int*)p != 1){
+        printf("%s: parent saw child's store\n", s);
+        exit(1);
+      }
+    }
+  }
+
+  sbrk(-BIG);
+}
+
 void
 sbrkbasic(char *s)
 {
@@ -2117,6 +2402,547 @@ sbrkmuch(char *s)
   }
 }
 
+// sbrk() only reserves address space, so a process can
+// grow far beyond physical memory as long as it touches
+// few of the pages. untouched pages must read as zero and
+// work as system call buffers.
+void
+sbrklazy(char *s)
+{
+  enum { HUGE=512*1024*1024 };
+  char *a, *p;
+  int fd, fds[2];
+
+  a = sbrk(HUGE);
+  if(a == (char*)0xffffffffffffffffL){
+    printf("%s: sbrk(%d) failed\n", s, HUGE);
+    exit(1);
+  }
+  for(p = a; p < a + HUGE; p += 1024*1024){
+    if(*p != 0){
+      printf("%s: fresh page not zero\n", s);
+      exit(1);
+    }
+    *p = 'x';
+  }
+
+  // copyout() into a page no one has touched.
+  fd = open("README", O_RDONLY);
+  if(fd < 0){
+    printf("%s: open(README) failed\n", s);
+    exit(1);
+  }
+  p = a + HUGE - 2*PGSIZE - 1000;
+  if(read(fd, p, 2000) != 2000){
+    printf("%s: read into lazy page failed\n", s);
+    exit(1);
+  }
+  close(fd);
+
+  // copyin() from a page no one has touched.
+  if(pipe(fds) < 0){
+    printf("%s: pipe() failed\n", s);
+    exit(1);
+  }
+  if(write(fds[1], a + HUGE/2 + 100, 10) != 10){
+    printf("%s: write from lazy page failed\n", s);
+    exit(1);
+  }
+  close(fds[0]);
+  close(fds[1]);
+
+  sbrk(-HUGE);
+}
+
+static char statsbuf[4096];
+
+// Read the statistics device's "vm:" line, and set
+// *mapped and *split to its megapage counts.
+// Returns 0, or -1 if there is no such line.
+int
+vmstats(int *mapped, int *split)
+{
+  int fd, n, m;
+  char *p;
+
+  if((fd = open("/statistics", O_RDONLY)) < 0)
+    return -1;
+  n = 0;
+  while(n < sizeof(statsbuf) - 1 &&
+        (m = read(fd, statsbuf + n, sizeof(statsbuf) - 1 - n)) > 0)
+    n += m;
+  close(fd);
+  statsbuf[n] = 0;
+  for(p = statsbuf; *p; p++){
+    if((p == statsbuf || p[-1] == '\n') && memcmp(p, "vm: ", 4) == 0){
+      *mapped = atoi(p + 4);
+      p = strchr(p, ',');
+      *split = p ? atoi(p + 2) : 0;
+      return 0;
+    }
+  }
+  return -1;
+}
+
+// a heap big enough for megapages: fill it, share it with a
+// child copy-on-write, then shrink it to the middle of a
+// megapage and check what's left. The statistics device
+// must show that megapages were mapped, and one split.
+void
+sbrkhuge(char *s)
+{
+  enum { BIG=8*1024*1024, MEGA=2*1024*1024 };
+  char *a, *p;
+  int pid, xstatus, mapped0, split0, mapped, split;
+
+  if(vmstats(&mapped0, &split0) < 0){
+    printf("%s: no vm: line in statistics\n", s);
+    exit(1);
+  }
+  a = sbrk(BIG);
+  if(a == (char*)0xffffffffffffffffL){
+    printf("%s: sbrk(%d) failed\n", s, BIG);
+    exit(1);
+  }
+  for(p = a; p < a + BIG; p += PGSIZE)
+    *p = (uint64)p >> 12;
+
+  // BIG holds at least BIG/MEGA - 1 aligned megapages.
+  if(vmstats(&mapped, &split) < 0 || mapped - mapped0 < BIG/MEGA - 1){
+    printf("%s: %d megapages mapped, not %d\n", s, mapped - mapped0, BIG/MEGA - 1);
+    exit(1);
+  }
+
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    for(p = a; p < a + BIG; p += PGSIZE){
+      if(*p != (char)((uint64)p >> 12)){
+        printf("%s: child saw wrong data\n", s);
+        exit(1);
+      }
+      *p = 0;
+    }
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != 0)
+    exit(xstatus);
+
+  // cut a megapage in two, if the heap has any.
+  if(sbrk(-(BIG/2 + 3*PGSIZE)) == (char*)0xffffffffffffffffL){
+    printf("%s: sbrk shrink failed\n", s);
+    exit(1);
+  }
+  for(p = a; p < a + BIG/2 - 3*PGSIZE; p += PGSIZE){
+    if(*p != (char)((uint64)p >> 12)){
+      printf("%s: parent's data changed\n", s);
+      exit(1);
+    }
+  }
+  // the new end lies inside a megapage.
+  if(vmstats(&mapped, &split) < 0 || split == split0){
+    printf("%s: shrinking split no megapage\n", s);
+    exit(1);
+  }
+  sbrk(-(BIG/2 - 3*PGSIZE));
+}
+
+// futexes and mutexes between processes, in a MAP_SHARED page.
+void
+futextest(char *s)
+{
+  enum { N=4, M=200 };
+  struct shared {
+    struct mutex m;
+    int count;
+    int flag;
+  } *sh;
+  char *f = "futexfile";
+  int fd, i, pid, xstatus;
+
+  unlink(f);
+  fd = open(f, O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf("%s: create %s failed\n", s, f);
+    exit(1);
+  }
+  memset(buf, 0, PGSIZE);
+  if(write(fd, buf, PGSIZE) != PGSIZE){
+    printf("%s: write %s failed\n", s, f);
+    exit(1);
+  }
+  sh = mmap(0, PGSIZE, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  if(sh == (struct shared*)0xffffffffffffffffL){
+    printf("%s: mmap failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  unlink(f);
+
+  if(futex_wait(&sh->flag, 1, 0) != -1){
+    printf("%s: futex_wait slept on the wrong value\n", s);
+    exit(1);
+  }
+  if(futex_wait(&sh->flag, 0, 10000000) != 1){
+    printf("%s: futex_wait didn't time out\n", s);
+    exit(1);
+  }
+
+  mutex_init(&sh->m);
+  for(i = 0; i < N; i++){
+    pid = fork();
+    if(pid < 0){
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if(pid == 0){
+      for(int j = 0; j < M; j++){
+        mutex_lock(&sh->m);
+        sh->count++;
+        mutex_unlock(&sh->m);
+      }
+      exit(0);
+    }
+  }
+  for(i = 0; i < N; i++){
+    wait(&xstatus);
+    if(xstatus != 0)
+      exit(xstatus);
+  }
+  if(sh->count != N*M){
+    printf("%s: count %d, not %d\n", s, sh->count, N*M);
+    exit(1);
+  }
+
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    while(sh->flag == 0)
+      futex_wait(&sh->flag, 0, 0);
+    exit(0);
+  }
+  sleep(1);
+  sh->flag = 1;
+  futex_wake(&sh->flag, 1);
+  wait(&xstatus);
+  exit(xstatus);
+}
+
+// O_NONBLOCK pipes fail rather than wait, and poll() waits
+// for them instead.
+void
+nonblocktest(char *s)
+{
+  struct pollfd pfd;
+  int fds[2], pid, xstatus;
+  char c;
+
+  if(pipe(fds) < 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  if(fcntl(fds[0], F_SETFL, O_NONBLOCK) < 0 || fcntl(fds[1], F_SETFL, O_NONBLOCK) < 0 ||
+     fcntl(fds[0], F_GETFL, 0) != (O_RDONLY|O_NONBLOCK)){
+    printf("%s: fcntl failed\n", s);
+    exit(1);
+  }
+  if(read(fds[0], &c, 1) != -1){
+    printf("%s: read of empty pipe didn't fail\n", s);
+    exit(1);
+  }
+  pfd.fd = fds[0];
+  pfd.events = POLLIN;
+  if(poll(&pfd, 1, 0) != 0 || poll(&pfd, 1, 50) != 0){
+    printf("%s: poll of empty pipe\n", s);
+    exit(1);
+  }
+
+  // fill the pipe; the last write is short, then none fit.
+  while((xstatus = write(fds[1], buf, 100)) == 100)
+    ;
+  if(xstatus <= 0 || write(fds[1], buf, 1) != -1){
+    printf("%s: write to full pipe\n", s);
+    exit(1);
+  }
+  pfd.fd = fds[1];
+  pfd.events = POLLOUT;
+  if(poll(&pfd, 1, 0) != 0){
+    printf("%s: poll of full pipe\n", s);
+    exit(1);
+  }
+
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    sleep(1);
+    read(fds[0], buf, 1);
+    exit(0);
+  }
+  if(poll(&pfd, 1, -1) != 1 || pfd.revents != POLLOUT){
+    printf("%s: poll didn't see room\n", s);
+    exit(1);
+  }
+  wait(&xstatus);
+  exit(xstatus);
+}
+
+struct {
+  struct mutex m;
+  int count;
+  int stop;
+  char *a;
+  char seen;
+} clonesh;
+
+void
+clonework(void *arg)
+{
+  int n = (uint64)arg;
+
+  for(int j = 0; j < n; j++){
+    char *p = malloc(64);
+    mutex_lock(&clonesh.m);
+    clonesh.count++;
+    mutex_unlock(&clonesh.m);
+    free(p);
+  }
+}
+
+void
+clonespin(void *arg)
+{
+  while(clonesh.stop == 0)
+    futex_wait(&clonesh.stop, 0, 0);
+  clonesh.seen = clonesh.a[0];
+}
+
+// threads share memory: they count under a mutex, and each
+// sees the others' sbrk(). exec() is refused while another
+// thread runs, and wait() doesn't reap threads.
+void
+clonetest(char *s)
+{
+  enum { N=4, M=200 };
+  struct thread t[N], spin;
+  char *a, *args[] = { "echo", 0 };
+  int i;
+
+  mutex_init(&clonesh.m);
+  clonesh.count = 0;
+  clonesh.stop = 0;
+  for(i = 0; i < N; i++){
+    if(thread_create(&t[i], clonework, (void*)M) < 0){
+      printf("%s: thread_create failed\n", s);
+      exit(1);
+    }
+  }
+  if(wait(0) != -1){
+    printf("%s: wait() reaped a thread\n", s);
+    exit(1);
+  }
+  for(i = 0; i < N; i++){
+    if(thread_join(&t[i]) < 0){
+      printf("%s: thread_join failed\n", s);
+      exit(1);
+    }
+  }
+  if(clonesh.count != N*M){
+    printf("%s: count %d, not %d\n", s, clonesh.count, N*M);
+    exit(1);
+  }
+
+  if(thread_create(&spin, clonespin, 0) < 0){
+    printf("%s: thread_create failed\n", s);
+    exit(1);
+  }
+  a = clonesh.a = sbrk(PGSIZE);
+  a[0] = 'x';
+  if(exec("echo", args) != -1){
+    printf("%s: exec with another thread running\n", s);
+    exit(1);
+  }
+  clonesh.stop = 1;
+  futex_wake(&clonesh.stop, 1);
+  if(thread_join(&spin) < 0 || thread_join(&spin) != -1){
+    printf("%s: join of spin thread\n", s);
+    exit(1);
+  }
+  if(clonesh.seen != 'x'){
+    printf("%s: thread didn't see sbrk() memory\n", s);
+    exit(1);
+  }
+  sbrk(-PGSIZE);
+}
+
+void
+threadexit7(void *arg)
+{
+  exit(7);
+}
+
+void
+threadsleep(void *arg)
+{
+  for(;;)
+    sleep(100);
+}
+
+// exit() from any thread ends the whole process, and the
+// parent's wait() gets its status; texit() ends one thread.
+void
+threadexittest(char *s)
+{
+  struct thread t;
+  int pid, xstatus;
+
+  // a thread's exit() kills the sleeping first thread.
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    if(thread_create(&t, threadexit7, 0) < 0)
+      exit(1);
+    for(;;)
+      sleep(100);
+  }
+  wait(&xstatus);
+  if(xstatus != 7){
+    printf("%s: thread's exit(7) gave %d\n", s, xstatus);
+    exit(1);
+  }
+
+  // the first thread's exit() kills a sleeping thread.
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    if(thread_create(&t, threadsleep, 0) < 0)
+      exit(1);
+    exit(3);
+  }
+  wait(&xstatus);
+  if(xstatus != 3){
+    printf("%s: exit(3) with a thread running gave %d\n", s, xstatus);
+    exit(1);
+  }
+}
+
+// mmap() a file privately and shared; check that stores to a
+// shared mapping, including a child's, reach the file after
+// munmap(), and that the tail past EOF reads as zero.
+void
+mmaptest(char *s)
+{
+  enum { SZ=2*PGSIZE+100 };
+  char *f = "mmapfile";
+  char *a;
+  int fd, i, pid, xstatus;
+
+  unlink(f);
+  fd = open(f, O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf("%s: create %s failed\n", s, f);
+    exit(1);
+  }
+  for(i = 0; i < SZ; i++){
+    buf[0] = 'a' + i % 26;
+    if(write(fd, buf, 1) != 1){
+      printf("%s: write %s failed\n", s, f);
+      exit(1);
+    }
+  }
+
+  // private: stores stay in this process.
+  a = mmap(0, SZ, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+  if(a == (char*)0xffffffffffffffffL){
+    printf("%s: mmap private failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < SZ; i++){
+    if(a[i] != 'a' + i % 26){
+      printf("%s: wrong byte %d in private mapping\n", s, i);
+      exit(1);
+    }
+  }
+  for(i = SZ; i < 3*PGSIZE; i++){
+    if(a[i] != 0){
+      printf("%s: byte past EOF not zero\n", s);
+      exit(1);
+    }
+  }
+  a[0] = 'X';
+  if(munmap(a, SZ) != 0){
+    printf("%s: munmap private failed\n", s);
+    exit(1);
+  }
+
+  // shared: stores by this process and a child reach the file.
+  a = mmap(0, SZ, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  if(a == (char*)0xffffffffffffffffL){
+    printf("%s: mmap shared failed\n", s);
+    exit(1);
+  }
+  if(a[0] != 'a'){
+    printf("%s: private store reached the file\n", s);
+    exit(1);
+  }
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    a[PGSIZE] = 'C';
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != 0)
+    exit(xstatus);
+  if(a[PGSIZE] != 'C'){
+    printf("%s: child's store not seen\n", s);
+    exit(1);
+  }
+  a[0] = 'P';
+  a[2*PGSIZE] = 'T';
+  // a length that wraps around the address space.
+  if(munmap(a, -PGSIZE) == 0){
+    printf("%s: munmap of huge length worked\n", s);
+    exit(1);
+  }
+  if(munmap(a, PGSIZE) != 0 || munmap(a + PGSIZE, 2*PGSIZE) != 0){
+    printf("%s: munmap shared failed\n", s);
+    exit(1);
+  }
+  close(fd);
+
+  fd = open(f, O_RDONLY);
+  if(read(fd, buf, SZ) != SZ){
+    printf("%s: read %s failed\n", s, f);
+    exit(1);
+  }
+  if(buf[0] != 'P' || buf[PGSIZE] != 'C' || buf[2*PGSIZE] != 'T' ||
+     buf[1] != 'b' || buf[SZ-1] != 'a' + (SZ-1) % 26){
+    printf("%s: file contents wrong after munmap\n", s);
+    exit(1);
+  }
+  close(fd);
+  unlink(f);
+}
+
 // can we read the kernel's memory?
 void
 kernmem(char *s)
@@ -2141,6 +2967,34 @@ kernmem(char *s)
   }
 }
 
+// jumping into the heap, which isn't executable, must kill
+// the process, whether or not the page is there yet.
+void
+heapexec(char *s)
+{
+  uint *code;
+  int pid, xstatus;
+
+  code = (uint*)sbrk(2*4096);
+  code[0] = 0x00008067;  // ret
+  for(int i = 0; i < 2; i++){
+    pid = fork();
+    if(pid < 0){
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if(pid == 0){
+      ((void (*)(void))(code + i*4096/sizeof(uint)))();
+      exit(0);
+    }
+    wait(&xstatus);
+    if(xstatus != -1){
+      printf("%s: executing the heap wasn't fatal\n", s);
+      exit(1);
+    }
+  }
+}
+
 // user code should not be able to write to addresses above MAXVA.
 void
 MAXVAplus(char *s)
@@ -2594,7 +3448,11 @@ struct test {
   {dirtest, "dirtest"},
   {exectest, "exectest"},
   {pipe1, "pipe1"},
+  {pipemany, "pipemany"},
   {killstatus, "killstatus"},
+  {setprio, "setprio"},
+  {edf, "edf"},
+  {nanosleeptest, "nanosleep"},
   {preempt, "preempt"},
   {exitwait, "exitwait"},
   {reparent, "reparent" },
@@ -2617,10 +3475,21 @@ struct test {
   {rmdot, "rmdot"},
   {dirfile, "dirfile"},
   {iref, "iref"},
+  {manyfds, "manyfds"},
   {forktest, "forktest"},
+  {manyprocs, "manyprocs"},
+  {cowfork, "cowfork"},
   {sbrkbasic, "sbrkbasic"},
   {sbrkmuch, "sbrkmuch"},
+  {sbrklazy, "sbrklazy"},
+  {sbrkhuge, "sbrkhuge"},
+  {mmaptest, "mmaptest"},
+  {futextest, "futex"},
+  {clonetest, "clone"},
+  {threadexittest, "threadexit"},
+  {nonblocktest, "nonblock"},
   {kernmem, "kernmem"},
+  {heapexec, "heapexec"},
   {MAXVAplus, "MAXVAplus"},
   {sbrkfail, "sbrkfail"},
   {sbrkarg, "sbrkarg"},
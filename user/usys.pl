@@ -36,3 +36,15 @@ entry("getpid");
 entry("sbrk");
 entry("sleep");
 entry("uptime");
+entry("mmap");
+entry("munmap");
+entry("setpriority");
+entry("sched_deadline");
+entry("nanosleep");
+entry("futex_wait");
+entry("futex_wake");
+entry("clone");
+entry("join");
+entry("fcntl");
+entry("poll");
+entry("texit");